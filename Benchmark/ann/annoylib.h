@@ -49,10 +49,20 @@ typedef unsigned __int64  uint64_t;
 #include <string.h>
 #include <math.h>
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <queue>
 #include <limits>
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+// Trees are built on several threads when the compiler has std::thread
+#define ANNOY_MULTITHREADED_BUILD
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#endif
+
 #ifdef _MSC_VER
 // Needed for Visual Studio to disable runtime checks for mempcy
 #pragma runtime_checks("s", off)
@@ -75,17 +85,44 @@ typedef unsigned __int64  uint64_t;
 #endif
 
 
-#if !defined(NO_MANUAL_VECTORIZATION) && defined(__GNUC__) && (__GNUC__ >6) && defined(__AVX512F__)  // See #402
+// The distance kernels are compiled for several instruction sets and the best
+// one the host supports is picked at runtime (see Kernels<T> below),
+// so a binary built without -march=native still runs vectorized everywhere.
+#if !defined(NO_MANUAL_VECTORIZATION) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 6)))  // See #402
+#pragma message "Using runtime-dispatched AVX2/AVX-512 instructions"
+#define USE_AVX2
+#define USE_AVX512
+#define ANNOY_RUNTIME_DISPATCH
+#define ANNOY_TARGET_AVX2 __attribute__((target("avx2,fma,popcnt,f16c")))
+#define ANNOY_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,popcnt,f16c")))
+#if defined(__clang__) || (__GNUC__ > 7)
+#define USE_AVX512_VPOPCNTDQ
+#define ANNOY_TARGET_AVX512_VPOPCNTDQ __attribute__((target("avx512vpopcntdq,avx512f,avx2,fma,popcnt,f16c")))
+#endif
+#elif !defined(NO_MANUAL_VECTORIZATION) && defined(_MSC_VER) && defined(__AVX512F__)
 #pragma message "Using 512-bit AVX instructions"
+#define USE_AVX2
 #define USE_AVX512
-#elif !defined(NO_MANUAL_VECTORIZATION) && defined(__AVX__) && defined (__SSE__) && defined(__SSE2__) && defined(__SSE3__)
-#pragma message "Using 128-bit AVX instructions"
-#define USE_AVX
+#ifdef __AVX512VPOPCNTDQ__
+#define USE_AVX512_VPOPCNTDQ
+#endif
+#elif !defined(NO_MANUAL_VECTORIZATION) && defined(_MSC_VER) && defined(__AVX2__)
+#pragma message "Using 256-bit AVX instructions"
+#define USE_AVX2
 #else
 #pragma message "Using no AVX instructions"
 #endif
 
-#if defined(USE_AVX) || defined(USE_AVX512)
+#ifndef ANNOY_TARGET_AVX2
+#define ANNOY_TARGET_AVX2
+#define ANNOY_TARGET_AVX512
+#endif
+#ifndef ANNOY_TARGET_AVX512_VPOPCNTDQ
+#define ANNOY_TARGET_AVX512_VPOPCNTDQ
+#endif
+
+#if defined(USE_AVX2) || defined(USE_AVX512)
 #if defined(_MSC_VER)
 #include <intrin.h>
 #elif defined(__GNUC__)
@@ -108,8 +145,26 @@ using std::pair;
 using std::numeric_limits;
 using std::make_pair;
 
+// Reduced precision element types for the stored vectors, see the V parameter
+// of AnnoyIndex. Queries and split computations stay in float; the kernels
+// widen the stored elements on the fly.
+struct Float16 {
+  uint16_t bits; // IEEE 754 half precision
+};
+
+struct BFloat16 {
+  uint16_t bits; // Upper half of a float
+};
+
+struct ScaledInt8 {
+  // Symmetric 8-bit code. The f codes of a vector are followed by one float
+  // scale, so that element z is code[z] * scale.
+  int8_t code;
+};
+
 inline void* remap_memory(void* _ptr, int _fd, size_t old_size, size_t new_size) {
 #ifdef __linux__
+  (void)_fd; // mremap keeps the file of the mapping
   _ptr = mremap(_ptr, old_size, new_size, MREMAP_MAYMOVE);
 #else
   munmap(_ptr, old_size);
@@ -122,15 +177,283 @@ inline void* remap_memory(void* _ptr, int _fd, size_t old_size, size_t new_size)
   return _ptr;
 }
 
+enum {
+  // How save() lays out the nodes (see set_layout)
+  ANNOY_LAYOUT_FLAT = 0,      // In the order of their ids
+  ANNOY_LAYOUT_SECTIONED = 1, // Items, leaves and splits in separate 2MB aligned sections
+  ANNOY_LAYOUT_BLOCKED = 2    // Sectioned, with the splits of each subtree packed into pages
+};
+
+enum {
+  // How on_disk_build writes the file back (see set_on_disk_writeback)
+  ANNOY_WRITEBACK_NONE = 0,     // Whenever the kernel likes
+  ANNOY_WRITEBACK_MSYNC = 1,    // msync every interval bytes
+  ANNOY_WRITEBACK_DONTNEED = 2  // Also drop the written trees from memory
+};
+
+class NodeArena {
+  /*
+   * Memory for the nodes of an index that is being built. Instead of
+   * growing a heap block (which copies all nodes every time), the arena
+   * reserves a large range of address space once and commits it in 2MB
+   * aligned chunks as the index grows, so nodes never move, the chunks can
+   * be backed by transparent huge pages, and fresh memory is already zero.
+   * With a file (see map_file) the arena maps the file instead, growing it
+   * by extents of a quarter of its size with posix_fallocate and mapping
+   * every new extent behind the previous ones: the pages already written
+   * stay mapped. Windows gets a plain heap block or a remapped file.
+   */
+public:
+  static const size_t chunk_size = (size_t)2 << 20;
+
+  NodeArena() : _data(NULL), _reserved(0), _committed(0), _mapped(0), _fd(-1) {}
+  ~NodeArena() {
+    release();
+  }
+
+  void map_file(int fd) {
+    // Backs the arena with fd, an empty file opened for reading and
+    // writing, which stays open until after release()
+    _fd = fd;
+  }
+
+  void* data() const {
+    return _data;
+  }
+
+  size_t committed() const {
+    return _committed;
+  }
+
+  void* grow(size_t size) {
+    // Makes at least size bytes usable, the new ones zero, and returns the
+    // base address, which only changes if the reservation runs out. NULL
+    // if there is no memory (or disk space).
+    if (size <= _committed)
+      return _data;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    size_t new_size = std::max(size, (size_t)(_committed * 1.3));
+    void* data;
+    if (_fd != -1) {
+      if (ftruncate(_fd, new_size) == -1)
+        return NULL;
+      data = _data ? remap_memory(_data, _fd, _committed, new_size)
+                   : mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+      if (data == MAP_FAILED)
+        return NULL;
+    } else {
+      data = realloc(_data, new_size);
+      if (!data)
+        return NULL;
+      memset((char*)data + _committed, 0, new_size - _committed);
+    }
+    _data = data;
+    _committed = new_size;
+#else
+    size_t new_size = _grown_size(size);
+    if (new_size > _reserved && !_move(new_size))
+      return NULL;
+    if (_fd != -1) {
+      if (!_extend_file(new_size))
+        return NULL;
+      if (new_size > _mapped) {
+        void* p = mmap((char*)_data + _mapped, new_size - _mapped, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, _fd, _mapped);
+        if (p == MAP_FAILED)
+          return NULL;
+        _mapped = new_size;
+      }
+    } else {
+      char* tail = (char*)_data + _committed;
+      if (mprotect(tail, new_size - _committed, PROT_READ | PROT_WRITE) == -1)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+      madvise(tail, new_size - _committed, MADV_HUGEPAGE);
+#endif
+    }
+    _committed = new_size;
+#endif
+    return _data;
+  }
+
+  bool grows_in_place(size_t size) const {
+    // True if grow(size) keeps the base address, so that pointers into the
+    // arena stay valid
+    if (size <= _committed)
+      return true;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    return false;
+#else
+    return _data && _grown_size(size) <= _reserved;
+#endif
+  }
+
+  bool truncate(size_t size) {
+    // Cuts the file down to its final size. The mapping stays as it is,
+    // but the bytes beyond size must not be touched anymore.
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    void* data = remap_memory(_data, _fd, _committed, size);
+    if (data == MAP_FAILED)
+      return false;
+    _data = data;
+#endif
+    if (ftruncate(_fd, size) == -1)
+      return false;
+    _committed = std::min(_committed, size);
+    return true;
+  }
+
+  static void* map_aligned(int fd, size_t size, int flags) {
+    // Maps size bytes of fd read-only at a chunk aligned address, so that
+    // the 2MB aligned ranges of the file can be backed by huge pages
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    return mmap(0, size, PROT_READ, flags, fd, 0);
+#else
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t rounded = (size + page - 1) & ~(page - 1);
+    void* p = _reserve(rounded);
+    if (!p)
+      return MAP_FAILED;
+    void* data = mmap(p, size, PROT_READ, flags | MAP_FIXED, fd, 0);
+    if (data == MAP_FAILED)
+      munmap(p, rounded);
+    return data;
+#endif
+  }
+
+  void release() {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    if (_fd != -1)
+      munmap(_data, _committed);
+    else
+      free(_data);
+#else
+    if (_data)
+      munmap(_data, _reserved);
+#endif
+    _data = NULL;
+    _reserved = 0;
+    _committed = 0;
+    _mapped = 0;
+    _fd = -1;
+  }
+
+  size_t hugepage_bytes() const {
+    // How much of the arena the kernel backs with huge pages right now, from
+    // the AnonHugePages of its mappings in /proc/self/smaps (0 elsewhere)
+    size_t total = 0;
+#ifdef __linux__
+    if (!_data || _fd != -1)
+      return 0;
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f)
+      return 0;
+    const uintptr_t begin = (uintptr_t)_data, end = begin + _reserved;
+    bool inside = false;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      unsigned long lo, hi, kb;
+      if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+        inside = lo < end && hi > begin;
+      else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+        total += (size_t)kb << 10;
+    }
+    fclose(f);
+#endif
+    return total;
+  }
+
+protected:
+  void* _data;
+  size_t _reserved;
+  size_t _committed;
+  size_t _mapped; // Of the file, which may be longer than _committed after truncate()
+  int _fd;
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+  size_t _grown_size(size_t size) const {
+    // What grow(size) commits: whole chunks, and extents of a quarter of the
+    // file
+    size_t new_size = _fd == -1 ? size : std::max(size, _committed + _committed / 4);
+    return (new_size + chunk_size - 1) & ~(chunk_size - 1);
+  }
+
+  static void* _reserve(size_t size) {
+    // Address space only: nothing is committed until it is made writable
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    char* p = (char*)mmap(NULL, size + chunk_size, PROT_NONE, flags, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+    // Trim it to a chunk aligned range
+    char* aligned = (char*)(((uintptr_t)p + chunk_size - 1) & ~(uintptr_t)(chunk_size - 1));
+    if (aligned > p)
+      munmap(p, aligned - p);
+    if (aligned + size < p + size + chunk_size)
+      munmap(aligned + size, p + size + chunk_size - (aligned + size));
+    return aligned;
+  }
+
+  bool _move(size_t needed) {
+    // Reserves a larger range, 1TB the first time (less if the address
+    // space is limited), and moves the committed memory there
+    size_t size = std::max(needed, _reserved * 2);
+    if (!_data)
+      size = std::max(size, sizeof(void*) == 8 ? (size_t)1 << 40 : (size_t)1 << 30);
+    void* data;
+    while (!(data = _reserve(size)) && size > needed)
+      size = std::max(needed, size / 2);
+    if (!data)
+      return false;
+    if (_fd != -1) {
+      // Nothing to copy, the file is just mapped again
+      if (_mapped && mmap(data, _mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd, 0) == MAP_FAILED) {
+        munmap(data, size);
+        return false;
+      }
+    } else if (_committed) {
+      if (mprotect(data, _committed, PROT_READ | PROT_WRITE) == -1) {
+        munmap(data, size);
+        return false;
+      }
+      memcpy(data, _data, _committed);
+    }
+    if (_data)
+      munmap(_data, _reserved);
+    _data = data;
+    _reserved = size;
+    return true;
+  }
+
+  bool _extend_file(size_t size) {
+    // Allocates the blocks up front where possible, so that writing through
+    // the mapping never finds the disk full
+#if defined(__linux__) || defined(__FreeBSD__)
+    int rc = posix_fallocate(_fd, _committed, size - _committed);
+    if (rc == 0)
+      return true;
+    if (rc != EINVAL && rc != EOPNOTSUPP) {
+      errno = rc;
+      return false;
+    }
+    // Not supported by this file system
+#endif
+    return ftruncate(_fd, size) == 0;
+  }
+#endif
+};
+
 namespace {
 
 template<typename S, typename Node>
 inline Node* get_node_ptr(const void* _nodes, const size_t _s, const S i) {
-  return (Node*)((uint8_t *)_nodes + (_s * i));
+  return (Node*)((uint8_t *)_nodes + (_s * (size_t)i));
 }
 
 template<typename T>
-inline T dot(const T* x, const T* y, int f) {
+inline T dot_scalar(const T* x, const T* y, int f) {
   T s = 0;
   for (int z = 0; z < f; z++) {
     s += (*x) * (*y);
@@ -141,7 +464,7 @@ inline T dot(const T* x, const T* y, int f) {
 }
 
 template<typename T>
-inline T manhattan_distance(const T* x, const T* y, int f) {
+inline T manhattan_distance_scalar(const T* x, const T* y, int f) {
   T d = 0.0;
   for (int i = 0; i < f; i++)
     d += fabs(x[i] - y[i]);
@@ -149,7 +472,7 @@ inline T manhattan_distance(const T* x, const T* y, int f) {
 }
 
 template<typename T>
-inline T euclidean_distance(const T* x, const T* y, int f) {
+inline T euclidean_distance_scalar(const T* x, const T* y, int f) {
   // Don't use dot-product: avoid catastrophic cancellation in #314.
   T d = 0.0;
   for (int i = 0; i < f; ++i) {
@@ -161,8 +484,60 @@ inline T euclidean_distance(const T* x, const T* y, int f) {
   return d;
 }
 
-#ifdef USE_AVX
+template<typename T>
+inline void dot_many_scalar(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = dot_scalar(x, ys[i], f);
+}
+
+template<typename T>
+inline void manhattan_distance_many_scalar(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = manhattan_distance_scalar(x, ys[i], f);
+}
+
+template<typename T>
+inline void euclidean_distance_many_scalar(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = euclidean_distance_scalar(x, ys[i], f);
+}
+
+template<typename T>
+inline T hamming_distance_scalar(const T* x, const T* y, int f) {
+  size_t dist = 0;
+  for (int i = 0; i < f; i++) {
+    dist += popcount(x[i] ^ y[i]);
+  }
+  return dist;
+}
+
+template<typename T>
+inline void hamming_distance_many_scalar(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = hamming_distance_scalar(x, ys[i], f);
+}
+
+template<typename T>
+inline void axpby_scalar(T a, const T* x, T b, T* y, int f) {
+  for (int z = 0; z < f; z++)
+    y[z] = a * x[z] + b * y[z];
+}
+
+template<typename T>
+inline void bit_occupancy_scalar(const T* const* vs, size_t n, int f, T* any, T* all) {
+  // ORs every vector into any and ANDs it into all, so that any & ~all has the
+  // bits set in some but not all of them
+  for (size_t i = 0; i < n; i++) {
+    for (int w = 0; w < f; w++) {
+      any[w] |= vs[i][w];
+      all[w] &= vs[i][w];
+    }
+  }
+}
+
+#ifdef USE_AVX2
 // Horizontal single sum of 256bit vector.
+ANNOY_TARGET_AVX2
 inline float hsum256_ps_avx(__m256 v) {
   const __m128 x128 = _mm_add_ps(_mm256_extractf128_ps(v, 1), _mm256_castps256_ps128(v));
   const __m128 x64 = _mm_add_ps(x128, _mm_movehl_ps(x128, x128));
@@ -170,13 +545,13 @@ inline float hsum256_ps_avx(__m256 v) {
   return _mm_cvtss_f32(x32);
 }
 
-template<>
-inline float dot<float>(const float* x, const float *y, int f) {
+ANNOY_TARGET_AVX2
+inline float dot_avx2(const float* x, const float *y, int f) {
   float result = 0;
   if (f > 7) {
     __m256 d = _mm256_setzero_ps();
     for (; f > 7; f -= 8) {
-      d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y)));
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y), d);
       x += 8;
       y += 8;
     }
@@ -192,8 +567,8 @@ inline float dot<float>(const float* x, const float *y, int f) {
   return result;
 }
 
-template<>
-inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX2
+inline float manhattan_distance_avx2(const float* x, const float* y, int f) {
   float result = 0;
   int i = f;
   if (f > 7) {
@@ -218,14 +593,14 @@ inline float manhattan_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
-template<>
-inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX2
+inline float euclidean_distance_avx2(const float* x, const float* y, int f) {
   float result=0;
   if (f > 7) {
     __m256 d = _mm256_setzero_ps();
     for (; f > 7; f -= 8) {
       const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
-      d = _mm256_add_ps(d, _mm256_mul_ps(diff, diff)); // no support for fmadd in AVX...
+      d = _mm256_fmadd_ps(diff, diff, d);
       x += 8;
       y += 8;
     }
@@ -242,11 +617,108 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
+// Horizontal single sum of 256bit vector of doubles.
+ANNOY_TARGET_AVX2
+inline double hsum256_pd_avx(__m256d v) {
+  const __m128d x128 = _mm_add_pd(_mm256_extractf128_pd(v, 1), _mm256_castpd256_pd128(v));
+  return _mm_cvtsd_f64(_mm_add_sd(x128, _mm_unpackhi_pd(x128, x128)));
+}
+
+// The double kernels keep four independent accumulators so that consecutive
+// FMAs don't wait on each other's latency.
+ANNOY_TARGET_AVX2
+inline double dot_avx2(const double* x, const double *y, int f) {
+  __m256d d0 = _mm256_setzero_pd(), d1 = _mm256_setzero_pd();
+  __m256d d2 = _mm256_setzero_pd(), d3 = _mm256_setzero_pd();
+  for (; f > 15; f -= 16) {
+    d0 = _mm256_fmadd_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y), d0);
+    d1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + 4), _mm256_loadu_pd(y + 4), d1);
+    d2 = _mm256_fmadd_pd(_mm256_loadu_pd(x + 8), _mm256_loadu_pd(y + 8), d2);
+    d3 = _mm256_fmadd_pd(_mm256_loadu_pd(x + 12), _mm256_loadu_pd(y + 12), d3);
+    x += 16;
+    y += 16;
+  }
+  for (; f > 3; f -= 4) {
+    d0 = _mm256_fmadd_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y), d0);
+    x += 4;
+    y += 4;
+  }
+  double result = hsum256_pd_avx(_mm256_add_pd(_mm256_add_pd(d0, d1), _mm256_add_pd(d2, d3)));
+  // Don't forget the remaining values.
+  for (; f > 0; f--) {
+    result += *x * *y;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+ANNOY_TARGET_AVX2
+inline double manhattan_distance_avx2(const double* x, const double* y, int f) {
+  const __m256d minus_zero = _mm256_set1_pd(-0.0);
+  __m256d d0 = _mm256_setzero_pd(), d1 = _mm256_setzero_pd();
+  __m256d d2 = _mm256_setzero_pd(), d3 = _mm256_setzero_pd();
+  for (; f > 15; f -= 16) {
+    d0 = _mm256_add_pd(d0, _mm256_andnot_pd(minus_zero, _mm256_sub_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y))));
+    d1 = _mm256_add_pd(d1, _mm256_andnot_pd(minus_zero, _mm256_sub_pd(_mm256_loadu_pd(x + 4), _mm256_loadu_pd(y + 4))));
+    d2 = _mm256_add_pd(d2, _mm256_andnot_pd(minus_zero, _mm256_sub_pd(_mm256_loadu_pd(x + 8), _mm256_loadu_pd(y + 8))));
+    d3 = _mm256_add_pd(d3, _mm256_andnot_pd(minus_zero, _mm256_sub_pd(_mm256_loadu_pd(x + 12), _mm256_loadu_pd(y + 12))));
+    x += 16;
+    y += 16;
+  }
+  for (; f > 3; f -= 4) {
+    d0 = _mm256_add_pd(d0, _mm256_andnot_pd(minus_zero, _mm256_sub_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y))));
+    x += 4;
+    y += 4;
+  }
+  double result = hsum256_pd_avx(_mm256_add_pd(_mm256_add_pd(d0, d1), _mm256_add_pd(d2, d3)));
+  // Don't forget the remaining values.
+  for (; f > 0; f--) {
+    result += fabs(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+ANNOY_TARGET_AVX2
+inline double euclidean_distance_avx2(const double* x, const double* y, int f) {
+  __m256d d0 = _mm256_setzero_pd(), d1 = _mm256_setzero_pd();
+  __m256d d2 = _mm256_setzero_pd(), d3 = _mm256_setzero_pd();
+  for (; f > 15; f -= 16) {
+    const __m256d diff0 = _mm256_sub_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y));
+    const __m256d diff1 = _mm256_sub_pd(_mm256_loadu_pd(x + 4), _mm256_loadu_pd(y + 4));
+    const __m256d diff2 = _mm256_sub_pd(_mm256_loadu_pd(x + 8), _mm256_loadu_pd(y + 8));
+    const __m256d diff3 = _mm256_sub_pd(_mm256_loadu_pd(x + 12), _mm256_loadu_pd(y + 12));
+    d0 = _mm256_fmadd_pd(diff0, diff0, d0);
+    d1 = _mm256_fmadd_pd(diff1, diff1, d1);
+    d2 = _mm256_fmadd_pd(diff2, diff2, d2);
+    d3 = _mm256_fmadd_pd(diff3, diff3, d3);
+    x += 16;
+    y += 16;
+  }
+  for (; f > 3; f -= 4) {
+    const __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y));
+    d0 = _mm256_fmadd_pd(diff, diff, d0);
+    x += 4;
+    y += 4;
+  }
+  double result = hsum256_pd_avx(_mm256_add_pd(_mm256_add_pd(d0, d1), _mm256_add_pd(d2, d3)));
+  // Don't forget the remaining values.
+  for (; f > 0; f--) {
+    double tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
 #endif
 
 #ifdef USE_AVX512
-template<>
-inline float dot<float>(const float* x, const float *y, int f) {
+ANNOY_TARGET_AVX512
+inline float dot_avx512(const float* x, const float *y, int f) {
   float result = 0;
   if (f > 15) {
     __m512 d = _mm512_setzero_ps();
@@ -268,8 +740,8 @@ inline float dot<float>(const float* x, const float *y, int f) {
   return result;
 }
 
-template<>
-inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX512
+inline float manhattan_distance_avx512(const float* x, const float* y, int f) {
   float result = 0;
   int i = f;
   if (f > 15) {
@@ -292,8 +764,8 @@ inline float manhattan_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
-template<>
-inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX512
+inline float euclidean_distance_avx512(const float* x, const float* y, int f) {
   float result=0;
   if (f > 15) {
     __m512 d = _mm512_setzero_ps();
@@ -316,553 +788,4030 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
+// The remainder of the double kernels is handled with a masked load instead of
+// a scalar loop; the masked-off lanes read as zero and don't contribute.
+ANNOY_TARGET_AVX512
+inline double dot_avx512(const double* x, const double *y, int f) {
+  __m512d d0 = _mm512_setzero_pd(), d1 = _mm512_setzero_pd();
+  __m512d d2 = _mm512_setzero_pd(), d3 = _mm512_setzero_pd();
+  for (; f > 31; f -= 32) {
+    d0 = _mm512_fmadd_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y), d0);
+    d1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + 8), _mm512_loadu_pd(y + 8), d1);
+    d2 = _mm512_fmadd_pd(_mm512_loadu_pd(x + 16), _mm512_loadu_pd(y + 16), d2);
+    d3 = _mm512_fmadd_pd(_mm512_loadu_pd(x + 24), _mm512_loadu_pd(y + 24), d3);
+    x += 32;
+    y += 32;
+  }
+  for (; f > 7; f -= 8) {
+    d0 = _mm512_fmadd_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y), d0);
+    x += 8;
+    y += 8;
+  }
+  if (f > 0) {
+    const __mmask8 m = (__mmask8)((1u << f) - 1);
+    d1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, x), _mm512_maskz_loadu_pd(m, y), d1);
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(d0, d1), _mm512_add_pd(d2, d3)));
+}
+
+ANNOY_TARGET_AVX512
+inline double manhattan_distance_avx512(const double* x, const double* y, int f) {
+  __m512d d0 = _mm512_setzero_pd(), d1 = _mm512_setzero_pd();
+  __m512d d2 = _mm512_setzero_pd(), d3 = _mm512_setzero_pd();
+  for (; f > 31; f -= 32) {
+    d0 = _mm512_add_pd(d0, _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y))));
+    d1 = _mm512_add_pd(d1, _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(x + 8), _mm512_loadu_pd(y + 8))));
+    d2 = _mm512_add_pd(d2, _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(x + 16), _mm512_loadu_pd(y + 16))));
+    d3 = _mm512_add_pd(d3, _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(x + 24), _mm512_loadu_pd(y + 24))));
+    x += 32;
+    y += 32;
+  }
+  for (; f > 7; f -= 8) {
+    d0 = _mm512_add_pd(d0, _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y))));
+    x += 8;
+    y += 8;
+  }
+  if (f > 0) {
+    const __mmask8 m = (__mmask8)((1u << f) - 1);
+    d1 = _mm512_add_pd(d1, _mm512_abs_pd(_mm512_sub_pd(_mm512_maskz_loadu_pd(m, x), _mm512_maskz_loadu_pd(m, y))));
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(d0, d1), _mm512_add_pd(d2, d3)));
+}
+
+ANNOY_TARGET_AVX512
+inline double euclidean_distance_avx512(const double* x, const double* y, int f) {
+  __m512d d0 = _mm512_setzero_pd(), d1 = _mm512_setzero_pd();
+  __m512d d2 = _mm512_setzero_pd(), d3 = _mm512_setzero_pd();
+  for (; f > 31; f -= 32) {
+    const __m512d diff0 = _mm512_sub_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y));
+    const __m512d diff1 = _mm512_sub_pd(_mm512_loadu_pd(x + 8), _mm512_loadu_pd(y + 8));
+    const __m512d diff2 = _mm512_sub_pd(_mm512_loadu_pd(x + 16), _mm512_loadu_pd(y + 16));
+    const __m512d diff3 = _mm512_sub_pd(_mm512_loadu_pd(x + 24), _mm512_loadu_pd(y + 24));
+    d0 = _mm512_fmadd_pd(diff0, diff0, d0);
+    d1 = _mm512_fmadd_pd(diff1, diff1, d1);
+    d2 = _mm512_fmadd_pd(diff2, diff2, d2);
+    d3 = _mm512_fmadd_pd(diff3, diff3, d3);
+    x += 32;
+    y += 32;
+  }
+  for (; f > 7; f -= 8) {
+    const __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y));
+    d0 = _mm512_fmadd_pd(diff, diff, d0);
+    x += 8;
+    y += 8;
+  }
+  if (f > 0) {
+    const __mmask8 m = (__mmask8)((1u << f) - 1);
+    const __m512d diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, x), _mm512_maskz_loadu_pd(m, y));
+    d1 = _mm512_fmadd_pd(diff, diff, d1);
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(d0, d1), _mm512_add_pd(d2, d3)));
+}
+
 #endif
 
- 
+#ifdef USE_AVX2
+// One-to-many kernels: they score a group of candidates against the same query
+// per pass, so every chunk of the query is loaded once for the whole group and
+// the horizontal sums of the group are done together at the very end. The
+// vector tail is handled with masked loads; masked-off lanes read as zero in
+// both the query and the candidates and contribute nothing.
+// The per-metric arithmetic is supplied by one of the *Op structs below.
+
 template<typename T>
-inline T get_norm(T* v, int f) {
-  return sqrt(dot(v, v, f));
+inline void prefetch_vectors(const T* const* ys, size_t n, int f) {
+  for (size_t i = 0; i < n; i++)
+    for (size_t b = 0; b < f * sizeof(T); b += 64)
+      _mm_prefetch((const char*)ys[i] + b, _MM_HINT_T0);
 }
 
-template<typename T, typename Random, typename Distance, typename Node>
-inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
-  /*
-    This algorithm is a huge heuristic. Empirically it works really well, but I
-    can't motivate it well. The basic idea is to keep two centroids and assign
-    points to either one of them. We weight each centroid by the number of points
-    assigned to it, so to balance it. 
-  */
-  static int iteration_steps = 200;
-  size_t count = nodes.size();
+// Horizontal sums of four 256bit vectors, packed into one vector.
+ANNOY_TARGET_AVX2
+inline __m128 hsum4_ps_avx(__m256 a0, __m256 a1, __m256 a2, __m256 a3) {
+  const __m256 t = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+  return _mm_add_ps(_mm256_castps256_ps128(t), _mm256_extractf128_ps(t, 1));
+}
 
-  size_t i = random.index(count);
-  size_t j = random.index(count-1);
-  j += (j >= i); // ensure that i != j
+ANNOY_TARGET_AVX2
+inline __m256d hsum4_pd_avx(__m256d a0, __m256d a1, __m256d a2, __m256d a3) {
+  const __m256d t0 = _mm256_hadd_pd(a0, a1);
+  const __m256d t1 = _mm256_hadd_pd(a2, a3);
+  return _mm256_add_pd(_mm256_permute2f128_pd(t0, t1, 0x20), _mm256_permute2f128_pd(t0, t1, 0x31));
+}
 
-  Distance::template copy_node<T, Node>(p, nodes[i], f);
-  Distance::template copy_node<T, Node>(q, nodes[j], f);
+struct DotOp {
+  ANNOY_TARGET_AVX2 static inline __m256 step(__m256 acc, __m256 x, __m256 y) { return _mm256_fmadd_ps(x, y, acc); }
+  ANNOY_TARGET_AVX2 static inline __m256d step(__m256d acc, __m256d x, __m256d y) { return _mm256_fmadd_pd(x, y, acc); }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512 static inline __m512 step(__m512 acc, __m512 x, __m512 y) { return _mm512_fmadd_ps(x, y, acc); }
+  ANNOY_TARGET_AVX512 static inline __m512d step(__m512d acc, __m512d x, __m512d y) { return _mm512_fmadd_pd(x, y, acc); }
+#endif
+};
 
-  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
-  Distance::init_node(p, f);
-  Distance::init_node(q, f);
+struct EuclideanOp {
+  ANNOY_TARGET_AVX2 static inline __m256 step(__m256 acc, __m256 x, __m256 y) {
+    const __m256 d = _mm256_sub_ps(x, y);
+    return _mm256_fmadd_ps(d, d, acc);
+  }
+  ANNOY_TARGET_AVX2 static inline __m256d step(__m256d acc, __m256d x, __m256d y) {
+    const __m256d d = _mm256_sub_pd(x, y);
+    return _mm256_fmadd_pd(d, d, acc);
+  }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512 static inline __m512 step(__m512 acc, __m512 x, __m512 y) {
+    const __m512 d = _mm512_sub_ps(x, y);
+    return _mm512_fmadd_ps(d, d, acc);
+  }
+  ANNOY_TARGET_AVX512 static inline __m512d step(__m512d acc, __m512d x, __m512d y) {
+    const __m512d d = _mm512_sub_pd(x, y);
+    return _mm512_fmadd_pd(d, d, acc);
+  }
+#endif
+};
 
-  int ic = 1, jc = 1;
-  for (int l = 0; l < iteration_steps; l++) {
-    size_t k = random.index(count);
-    T di = ic * Distance::distance(p, nodes[k], f),
-      dj = jc * Distance::distance(q, nodes[k], f);
-    T norm = cosine ? get_norm(nodes[k]->v, f) : 1.0;
-    if (!(norm > T(0))) {
-      continue;
+struct ManhattanOp {
+  ANNOY_TARGET_AVX2 static inline __m256 step(__m256 acc, __m256 x, __m256 y) {
+    return _mm256_add_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(x, y)));
+  }
+  ANNOY_TARGET_AVX2 static inline __m256d step(__m256d acc, __m256d x, __m256d y) {
+    return _mm256_add_pd(acc, _mm256_andnot_pd(_mm256_set1_pd(-0.0), _mm256_sub_pd(x, y)));
+  }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512 static inline __m512 step(__m512 acc, __m512 x, __m512 y) {
+    return _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(x, y)));
+  }
+  ANNOY_TARGET_AVX512 static inline __m512d step(__m512d acc, __m512d x, __m512d y) {
+    return _mm512_add_pd(acc, _mm512_abs_pd(_mm512_sub_pd(x, y)));
+  }
+#endif
+};
+
+// F > 0 fixes the dimension at compile time (see fixed_dim_kernels), f is
+// then ignored.
+template<typename Op, int F=0>
+ANNOY_TARGET_AVX2
+inline void distance_many_avx2(const float* x, const float* const* ys, size_t n, int f, float* out) {
+  if (F) f = F;
+  const int tail = f & 7;
+  const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(tail), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  for (size_t i = 0; i < n; i += 4) {
+    const float* y[4];
+    for (size_t k = 0; k < 4; k++)
+      y[k] = ys[i + k < n ? i + k : i]; // Pad the last group by repeating a candidate
+    if (i + 4 < n)
+      prefetch_vectors(ys + i + 4, std::min(n - i - 4, (size_t)4), f);
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    int z = 0;
+    for (; z + 8 <= f; z += 8) {
+      const __m256 q = _mm256_loadu_ps(x + z);
+      a0 = Op::step(a0, q, _mm256_loadu_ps(y[0] + z));
+      a1 = Op::step(a1, q, _mm256_loadu_ps(y[1] + z));
+      a2 = Op::step(a2, q, _mm256_loadu_ps(y[2] + z));
+      a3 = Op::step(a3, q, _mm256_loadu_ps(y[3] + z));
     }
-    if (di < dj) {
-      for (int z = 0; z < f; z++)
-        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
-      Distance::init_node(p, f);
-      ic++;
-    } else if (dj < di) {
-      for (int z = 0; z < f; z++)
-        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
-      Distance::init_node(q, f);
-      jc++;
+    if (tail) {
+      const __m256 q = _mm256_maskload_ps(x + z, mask);
+      a0 = Op::step(a0, q, _mm256_maskload_ps(y[0] + z, mask));
+      a1 = Op::step(a1, q, _mm256_maskload_ps(y[1] + z, mask));
+      a2 = Op::step(a2, q, _mm256_maskload_ps(y[2] + z, mask));
+      a3 = Op::step(a3, q, _mm256_maskload_ps(y[3] + z, mask));
     }
+    float sums[4];
+    _mm_storeu_ps(sums, hsum4_ps_avx(a0, a1, a2, a3));
+    for (size_t k = 0; k < 4 && i + k < n; k++)
+      out[i + k] = sums[k];
   }
 }
-} // namespace
 
-struct Base {
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // Override this in specific metric structs below if you need to do any pre-processing
-    // on the entire set of nodes passed into this index.
+template<typename Op, int F=0>
+ANNOY_TARGET_AVX2
+inline void distance_many_avx2(const double* x, const double* const* ys, size_t n, int f, double* out) {
+  if (F) f = F;
+  const int tail = f & 3;
+  const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(tail), _mm256_setr_epi64x(0, 1, 2, 3));
+  for (size_t i = 0; i < n; i += 4) {
+    const double* y[4];
+    for (size_t k = 0; k < 4; k++)
+      y[k] = ys[i + k < n ? i + k : i];
+    if (i + 4 < n)
+      prefetch_vectors(ys + i + 4, std::min(n - i - 4, (size_t)4), f);
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    __m256d a2 = _mm256_setzero_pd(), a3 = _mm256_setzero_pd();
+    int z = 0;
+    for (; z + 4 <= f; z += 4) {
+      const __m256d q = _mm256_loadu_pd(x + z);
+      a0 = Op::step(a0, q, _mm256_loadu_pd(y[0] + z));
+      a1 = Op::step(a1, q, _mm256_loadu_pd(y[1] + z));
+      a2 = Op::step(a2, q, _mm256_loadu_pd(y[2] + z));
+      a3 = Op::step(a3, q, _mm256_loadu_pd(y[3] + z));
+    }
+    if (tail) {
+      const __m256d q = _mm256_maskload_pd(x + z, mask);
+      a0 = Op::step(a0, q, _mm256_maskload_pd(y[0] + z, mask));
+      a1 = Op::step(a1, q, _mm256_maskload_pd(y[1] + z, mask));
+      a2 = Op::step(a2, q, _mm256_maskload_pd(y[2] + z, mask));
+      a3 = Op::step(a3, q, _mm256_maskload_pd(y[3] + z, mask));
+    }
+    double sums[4];
+    _mm256_storeu_pd(sums, hsum4_pd_avx(a0, a1, a2, a3));
+    for (size_t k = 0; k < 4 && i + k < n; k++)
+      out[i + k] = sums[k];
   }
+}
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    // Initialize any fields that require sane defaults within this node.
-  }
+#ifdef USE_AVX512
+// Folds a 512bit vector into 256 bits so the AVX2 horizontal sums can be reused.
+ANNOY_TARGET_AVX512
+inline __m256 fold512_ps(__m512 v) {
+  return _mm256_add_ps(_mm512_castps512_ps256(v), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
-  }
+ANNOY_TARGET_AVX512
+inline __m256d fold512_pd(__m512d v) {
+  return _mm256_add_pd(_mm512_castpd512_pd256(v), _mm512_extractf64x4_pd(v, 1));
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = get_norm(node->v, f);
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
+// The AVX-512 versions score eight candidates per pass.
+template<typename Op, int F=0>
+ANNOY_TARGET_AVX512
+inline void distance_many_avx512(const float* x, const float* const* ys, size_t n, int f, float* out) {
+  if (F) f = F;
+  const int tail = f & 15;
+  const __mmask16 mask = (__mmask16)((1u << tail) - 1);
+  for (size_t i = 0; i < n; i += 8) {
+    const float* y[8];
+    for (size_t k = 0; k < 8; k++)
+      y[k] = ys[i + k < n ? i + k : i];
+    if (i + 8 < n)
+      prefetch_vectors(ys + i + 8, std::min(n - i - 8, (size_t)8), f);
+    __m512 a[8];
+    for (int k = 0; k < 8; k++)
+      a[k] = _mm512_setzero_ps();
+    int z = 0;
+    for (; z + 16 <= f; z += 16) {
+      const __m512 q = _mm512_loadu_ps(x + z);
+      for (int k = 0; k < 8; k++)
+        a[k] = Op::step(a[k], q, _mm512_loadu_ps(y[k] + z));
     }
+    if (tail) {
+      const __m512 q = _mm512_maskz_loadu_ps(mask, x + z);
+      for (int k = 0; k < 8; k++)
+        a[k] = Op::step(a[k], q, _mm512_maskz_loadu_ps(mask, y[k] + z));
+    }
+    float sums[8];
+    _mm_storeu_ps(sums, hsum4_ps_avx(fold512_ps(a[0]), fold512_ps(a[1]), fold512_ps(a[2]), fold512_ps(a[3])));
+    _mm_storeu_ps(sums + 4, hsum4_ps_avx(fold512_ps(a[4]), fold512_ps(a[5]), fold512_ps(a[6]), fold512_ps(a[7])));
+    for (size_t k = 0; k < 8 && i + k < n; k++)
+      out[i + k] = sums[k];
   }
-};
+}
 
-struct Angular : Base {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    /*
-     * We store a binary tree where each node has two things
-     * - A vector associated with it
-     * - Two children
-     * All nodes occupy the same amount of memory
-     * All nodes with n_descendants == 1 are leaf nodes.
-     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
-     * we skip the vector. Instead we store a list of all descendants. K is
-     * determined by the number of items that fits in the space of the vector.
-     * For nodes with n_descendants == 1 the vector is a data point.
-     * For nodes with n_descendants > K the vector is the normal of the split plane.
-     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
-     * more memory to be able to fit the vector outside
-     */
-    S n_descendants;
-    union {
-      S children[2]; // Will possibly store more than 2
-      T norm;
-    };
-    T v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
-  };
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    // want to calculate (a/|a| - b/|b|)^2
-    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
-    // = 2 - 2cos
-    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
-    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
-    T pq = dot(x->v, y->v, f);
-    T ppqq = pp * qq;
-    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
-    else return 2.0; // cos is 0
+template<typename Op, int F=0>
+ANNOY_TARGET_AVX512
+inline void distance_many_avx512(const double* x, const double* const* ys, size_t n, int f, double* out) {
+  if (F) f = F;
+  const int tail = f & 7;
+  const __mmask8 mask = (__mmask8)((1u << tail) - 1);
+  for (size_t i = 0; i < n; i += 8) {
+    const double* y[8];
+    for (size_t k = 0; k < 8; k++)
+      y[k] = ys[i + k < n ? i + k : i];
+    if (i + 8 < n)
+      prefetch_vectors(ys + i + 8, std::min(n - i - 8, (size_t)8), f);
+    __m512d a[8];
+    for (int k = 0; k < 8; k++)
+      a[k] = _mm512_setzero_pd();
+    int z = 0;
+    for (; z + 8 <= f; z += 8) {
+      const __m512d q = _mm512_loadu_pd(x + z);
+      for (int k = 0; k < 8; k++)
+        a[k] = Op::step(a[k], q, _mm512_loadu_pd(y[k] + z));
+    }
+    if (tail) {
+      const __m512d q = _mm512_maskz_loadu_pd(mask, x + z);
+      for (int k = 0; k < 8; k++)
+        a[k] = Op::step(a[k], q, _mm512_maskz_loadu_pd(mask, y[k] + z));
+    }
+    double sums[8];
+    _mm256_storeu_pd(sums, hsum4_pd_avx(fold512_pd(a[0]), fold512_pd(a[1]), fold512_pd(a[2]), fold512_pd(a[3])));
+    _mm256_storeu_pd(sums + 4, hsum4_pd_avx(fold512_pd(a[4]), fold512_pd(a[5]), fold512_pd(a[6]), fold512_pd(a[7])));
+    for (size_t k = 0; k < 8 && i + k < n; k++)
+      out[i + k] = sums[k];
   }
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f);
+}
+#endif
+
+// Single pair kernels for a dimension F known at compile time: the loops
+// unroll into four independent accumulators and the tail is resolved when
+// compiling, so there is no remainder loop.
+template<typename Op, int F>
+ANNOY_TARGET_AVX2
+inline float distance_fixed_avx2(const float* x, const float* y, int) {
+  __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+  __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+  int z = 0;
+  for (; z + 32 <= F; z += 32) {
+    a0 = Op::step(a0, _mm256_loadu_ps(x + z), _mm256_loadu_ps(y + z));
+    a1 = Op::step(a1, _mm256_loadu_ps(x + z + 8), _mm256_loadu_ps(y + z + 8));
+    a2 = Op::step(a2, _mm256_loadu_ps(x + z + 16), _mm256_loadu_ps(y + z + 16));
+    a3 = Op::step(a3, _mm256_loadu_ps(x + z + 24), _mm256_loadu_ps(y + z + 24));
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return random.flip();
+  if (z + 8 <= F) { a0 = Op::step(a0, _mm256_loadu_ps(x + z), _mm256_loadu_ps(y + z)); z += 8; }
+  if (z + 8 <= F) { a1 = Op::step(a1, _mm256_loadu_ps(x + z), _mm256_loadu_ps(y + z)); z += 8; }
+  if (z + 8 <= F) { a2 = Op::step(a2, _mm256_loadu_ps(x + z), _mm256_loadu_ps(y + z)); z += 8; }
+  if (F & 7) {
+    const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(F & 7), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    a3 = Op::step(a3, _mm256_maskload_ps(x + z, mask), _mm256_maskload_ps(y + z, mask));
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
+  return hsum256_ps_avx(_mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3)));
+}
+
+template<typename Op, int F>
+ANNOY_TARGET_AVX2
+inline double distance_fixed_avx2(const double* x, const double* y, int) {
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  __m256d a2 = _mm256_setzero_pd(), a3 = _mm256_setzero_pd();
+  int z = 0;
+  for (; z + 16 <= F; z += 16) {
+    a0 = Op::step(a0, _mm256_loadu_pd(x + z), _mm256_loadu_pd(y + z));
+    a1 = Op::step(a1, _mm256_loadu_pd(x + z + 4), _mm256_loadu_pd(y + z + 4));
+    a2 = Op::step(a2, _mm256_loadu_pd(x + z + 8), _mm256_loadu_pd(y + z + 8));
+    a3 = Op::step(a3, _mm256_loadu_pd(x + z + 12), _mm256_loadu_pd(y + z + 12));
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    // Used when requesting distances from Python layer
-    // Turns out sometimes the squared distance is -0.0
-    // so we have to make sure it's a positive number.
-    return sqrt(std::max(distance, T(0)));
+  if (z + 4 <= F) { a0 = Op::step(a0, _mm256_loadu_pd(x + z), _mm256_loadu_pd(y + z)); z += 4; }
+  if (z + 4 <= F) { a1 = Op::step(a1, _mm256_loadu_pd(x + z), _mm256_loadu_pd(y + z)); z += 4; }
+  if (z + 4 <= F) { a2 = Op::step(a2, _mm256_loadu_pd(x + z), _mm256_loadu_pd(y + z)); z += 4; }
+  if (F & 3) {
+    const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(F & 3), _mm256_setr_epi64x(0, 1, 2, 3));
+    a3 = Op::step(a3, _mm256_maskload_pd(x + z, mask), _mm256_maskload_pd(y + z, mask));
   }
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
+  return hsum256_pd_avx(_mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3)));
+}
+
+#ifdef USE_AVX512
+template<typename Op, int F>
+ANNOY_TARGET_AVX512
+inline float distance_fixed_avx512(const float* x, const float* y, int) {
+  __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+  __m512 a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+  int z = 0;
+  for (; z + 64 <= F; z += 64) {
+    a0 = Op::step(a0, _mm512_loadu_ps(x + z), _mm512_loadu_ps(y + z));
+    a1 = Op::step(a1, _mm512_loadu_ps(x + z + 16), _mm512_loadu_ps(y + z + 16));
+    a2 = Op::step(a2, _mm512_loadu_ps(x + z + 32), _mm512_loadu_ps(y + z + 32));
+    a3 = Op::step(a3, _mm512_loadu_ps(x + z + 48), _mm512_loadu_ps(y + z + 48));
   }
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+  if (z + 16 <= F) { a0 = Op::step(a0, _mm512_loadu_ps(x + z), _mm512_loadu_ps(y + z)); z += 16; }
+  if (z + 16 <= F) { a1 = Op::step(a1, _mm512_loadu_ps(x + z), _mm512_loadu_ps(y + z)); z += 16; }
+  if (z + 16 <= F) { a2 = Op::step(a2, _mm512_loadu_ps(x + z), _mm512_loadu_ps(y + z)); z += 16; }
+  if (F & 15) {
+    const __mmask16 mask = (__mmask16)((1u << (F & 15)) - 1);
+    a3 = Op::step(a3, _mm512_maskz_loadu_ps(mask, x + z), _mm512_maskz_loadu_ps(mask, y + z));
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
-    n->norm = dot(n->v, n->v, f);
+  return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(a0, a1), _mm512_add_ps(a2, a3)));
+}
+
+template<typename Op, int F>
+ANNOY_TARGET_AVX512
+inline double distance_fixed_avx512(const double* x, const double* y, int) {
+  __m512d a0 = _mm512_setzero_pd(), a1 = _mm512_setzero_pd();
+  __m512d a2 = _mm512_setzero_pd(), a3 = _mm512_setzero_pd();
+  int z = 0;
+  for (; z + 32 <= F; z += 32) {
+    a0 = Op::step(a0, _mm512_loadu_pd(x + z), _mm512_loadu_pd(y + z));
+    a1 = Op::step(a1, _mm512_loadu_pd(x + z + 8), _mm512_loadu_pd(y + z + 8));
+    a2 = Op::step(a2, _mm512_loadu_pd(x + z + 16), _mm512_loadu_pd(y + z + 16));
+    a3 = Op::step(a3, _mm512_loadu_pd(x + z + 24), _mm512_loadu_pd(y + z + 24));
   }
-  static const char* name() {
-    return "angular";
+  if (z + 8 <= F) { a0 = Op::step(a0, _mm512_loadu_pd(x + z), _mm512_loadu_pd(y + z)); z += 8; }
+  if (z + 8 <= F) { a1 = Op::step(a1, _mm512_loadu_pd(x + z), _mm512_loadu_pd(y + z)); z += 8; }
+  if (z + 8 <= F) { a2 = Op::step(a2, _mm512_loadu_pd(x + z), _mm512_loadu_pd(y + z)); z += 8; }
+  if (F & 7) {
+    const __mmask8 mask = (__mmask8)((1u << (F & 7)) - 1);
+    a3 = Op::step(a3, _mm512_maskz_loadu_pd(mask, x + z), _mm512_maskz_loadu_pd(mask, y + z));
   }
-};
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(a0, a1), _mm512_add_pd(a2, a3)));
+}
+#endif
 
+#endif
 
-struct DotProduct : Angular {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    /*
-     * This is an extension of the Angular node with an extra attribute for the scaled norm.
-     */
-    S n_descendants;
-    S children[2]; // Will possibly store more than 2
-    T dot_factor;
-    T v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
-  };
+#ifdef USE_AVX2
+// y = a * x + b * y, the centroid update of two_means()
+ANNOY_TARGET_AVX2
+inline void axpby_avx2(float a, const float* x, float b, float* y, int f) {
+  const __m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+  int z = 0;
+  for (; z + 8 <= f; z += 8)
+    _mm256_storeu_ps(y + z, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + z), _mm256_mul_ps(vb, _mm256_loadu_ps(y + z))));
+  for (; z < f; z++)
+    y[z] = a * x[z] + b * y[z];
+}
 
-  static const char* name() {
-    return "dot";
-  }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return -dot(x->v, y->v, f);
-  }
+ANNOY_TARGET_AVX2
+inline void axpby_avx2(double a, const double* x, double b, double* y, int f) {
+  const __m256d va = _mm256_set1_pd(a), vb = _mm256_set1_pd(b);
+  int z = 0;
+  for (; z + 4 <= f; z += 4)
+    _mm256_storeu_pd(y + z, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + z), _mm256_mul_pd(vb, _mm256_loadu_pd(y + z))));
+  for (; z < f; z++)
+    y[z] = a * x[z] + b * y[z];
+}
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    dest->dot_factor = 0;
+#ifdef USE_AVX512
+ANNOY_TARGET_AVX512
+inline void axpby_avx512(float a, const float* x, float b, float* y, int f) {
+  const __m512 va = _mm512_set1_ps(a), vb = _mm512_set1_ps(b);
+  int z = 0;
+  for (; z + 16 <= f; z += 16)
+    _mm512_storeu_ps(y + z, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + z), _mm512_mul_ps(vb, _mm512_loadu_ps(y + z))));
+  if (z < f) {
+    const __mmask16 m = (__mmask16)((1u << (f - z)) - 1);
+    _mm512_mask_storeu_ps(y + z, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + z), _mm512_mul_ps(vb, _mm512_maskz_loadu_ps(m, y + z))));
   }
+}
 
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+ANNOY_TARGET_AVX512
+inline void axpby_avx512(double a, const double* x, double b, double* y, int f) {
+  const __m512d va = _mm512_set1_pd(a), vb = _mm512_set1_pd(b);
+  int z = 0;
+  for (; z + 8 <= f; z += 8)
+    _mm512_storeu_pd(y + z, _mm512_fmadd_pd(va, _mm512_loadu_pd(x + z), _mm512_mul_pd(vb, _mm512_loadu_pd(y + z))));
+  if (z < f) {
+    const __mmask8 m = (__mmask8)((1u << (f - z)) - 1);
+    _mm512_mask_storeu_pd(y + z, m, _mm512_fmadd_pd(va, _mm512_maskz_loadu_pd(m, x + z), _mm512_mul_pd(vb, _mm512_maskz_loadu_pd(m, y + z))));
   }
+}
+#endif
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
-    dest->dot_factor = source->dot_factor;
+#endif
+
+#ifdef USE_AVX2
+// Hamming kernels. Hamming packs its bits into uint64_t words, so these only
+// exist for that element type (see isa_kernels<uint64_t>).
+
+// Per-64bit-lane popcount via nibble lookup (Mula et al.)
+ANNOY_TARGET_AVX2
+inline __m256i popcount256_epi64(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+  const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+// Carry-save adder: adds three bit vectors into a sum (l) and carry (h) vector.
+ANNOY_TARGET_AVX2
+inline void csa256(__m256i* h, __m256i* l, __m256i a, __m256i b, __m256i c) {
+  const __m256i u = _mm256_xor_si256(a, b);
+  *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+  *l = _mm256_xor_si256(u, c);
+}
+
+ANNOY_TARGET_AVX2
+inline uint64_t hamming_distance_avx2(const uint64_t* x, const uint64_t* y, int f) {
+  // Harley-Seal: blocks of four vectors (1024 bits) are reduced with carry-save
+  // adders so that only one popcount is needed per block.
+  __m256i total = _mm256_setzero_si256();
+  __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 16 <= f; i += 16) {
+    __m256i twos_a, twos_b, fours;
+    csa256(&twos_a, &ones, ones,
+           _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + i)), _mm256_loadu_si256((const __m256i*)(y + i))),
+           _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + i + 4)), _mm256_loadu_si256((const __m256i*)(y + i + 4))));
+    csa256(&twos_b, &ones, ones,
+           _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + i + 8)), _mm256_loadu_si256((const __m256i*)(y + i + 8))),
+           _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + i + 12)), _mm256_loadu_si256((const __m256i*)(y + i + 12))));
+    csa256(&fours, &twos, twos, twos_a, twos_b);
+    total = _mm256_add_epi64(total, popcount256_epi64(fours));
   }
+  total = _mm256_slli_epi64(total, 2);
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256_epi64(twos), 1));
+  total = _mm256_add_epi64(total, popcount256_epi64(ones));
+  for (; i + 4 <= f; i += 4) {
+    const __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + i)), _mm256_loadu_si256((const __m256i*)(y + i)));
+    total = _mm256_add_epi64(total, popcount256_epi64(d));
+  }
+  uint64_t dist = (uint64_t)_mm256_extract_epi64(total, 0) + (uint64_t)_mm256_extract_epi64(total, 1)
+                + (uint64_t)_mm256_extract_epi64(total, 2) + (uint64_t)_mm256_extract_epi64(total, 3);
+  for (; i < f; i++)
+    dist += _mm_popcnt_u64(x[i] ^ y[i]);
+  return dist;
+}
 
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    DotProduct::zero_value(p); 
-    DotProduct::zero_value(q);
-    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    n->dot_factor = p->dot_factor - q->dot_factor;
-    DotProduct::normalize<T, Node<S, T> >(n, f);
+ANNOY_TARGET_AVX2
+inline void hamming_distance_many_avx2(const uint64_t* x, const uint64_t* const* ys, size_t n, int f, uint64_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    if (i + 1 < n)
+      prefetch_vectors(ys + i + 1, 1, f);
+    out[i] = hamming_distance_avx2(x, ys[i], f);
   }
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
-      node->dot_factor /= norm;
+ANNOY_TARGET_AVX2
+inline void bit_occupancy_avx2(const uint64_t* const* vs, size_t n, int f, uint64_t* any, uint64_t* all) {
+  int w = 0;
+  for (; w + 4 <= f; w += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(any + w));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(all + w));
+    for (size_t i = 0; i < n; i++) {
+      const __m256i v = _mm256_loadu_si256((const __m256i*)(vs[i] + w));
+      a = _mm256_or_si256(a, v);
+      b = _mm256_and_si256(b, v);
+    }
+    _mm256_storeu_si256((__m256i*)(any + w), a);
+    _mm256_storeu_si256((__m256i*)(all + w), b);
+  }
+  for (; w < f; w++) {
+    for (size_t i = 0; i < n; i++) {
+      any[w] |= vs[i][w];
+      all[w] &= vs[i][w];
     }
   }
+}
+#endif
 
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+#ifdef USE_AVX512_VPOPCNTDQ
+ANNOY_TARGET_AVX512_VPOPCNTDQ
+inline uint64_t hamming_distance_avx512(const uint64_t* x, const uint64_t* y, int f) {
+  __m512i d0 = _mm512_setzero_si512(), d1 = _mm512_setzero_si512();
+  for (; f > 15; f -= 16) {
+    d0 = _mm512_add_epi64(d0, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(x), _mm512_loadu_si512(y))));
+    d1 = _mm512_add_epi64(d1, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(x + 8), _mm512_loadu_si512(y + 8))));
+    x += 16;
+    y += 16;
+  }
+  for (; f > 7; f -= 8) {
+    d0 = _mm512_add_epi64(d0, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(x), _mm512_loadu_si512(y))));
+    x += 8;
+    y += 8;
   }
+  if (f > 0) {
+    const __mmask8 m = (__mmask8)((1u << f) - 1);
+    d1 = _mm512_add_epi64(d1, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(m, x), _mm512_maskz_loadu_epi64(m, y))));
+  }
+  return _mm512_reduce_add_epi64(_mm512_add_epi64(d0, d1));
+}
 
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return random.flip();
+ANNOY_TARGET_AVX512_VPOPCNTDQ
+inline void hamming_distance_many_avx512(const uint64_t* x, const uint64_t* const* ys, size_t n, int f, uint64_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    if (i + 1 < n)
+      prefetch_vectors(ys + i + 1, 1, f);
+    out[i] = hamming_distance_avx512(x, ys[i], f);
   }
+}
 
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return -distance;
+ANNOY_TARGET_AVX512_VPOPCNTDQ
+inline void bit_occupancy_avx512(const uint64_t* const* vs, size_t n, int f, uint64_t* any, uint64_t* all) {
+  for (int w = 0; w < f; w += 8) {
+    const __mmask8 m = (__mmask8)(f - w >= 8 ? 0xff : (1u << (f - w)) - 1);
+    __m512i a = _mm512_maskz_loadu_epi64(m, any + w);
+    __m512i b = _mm512_maskz_loadu_epi64(m, all + w);
+    for (size_t i = 0; i < n; i++) {
+      const __m512i v = _mm512_maskz_loadu_epi64(m, vs[i] + w);
+      a = _mm512_or_si512(a, v);
+      b = _mm512_and_si512(b, v);
+    }
+    _mm512_mask_storeu_epi64(any + w, m, a);
+    _mm512_mask_storeu_epi64(all + w, m, b);
   }
+}
+#endif
 
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
-    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+enum {
+  ANNOY_ISA_SCALAR = 0,
+  ANNOY_ISA_AVX2 = 1,             // AVX2 + FMA + F16C
+  ANNOY_ISA_AVX512 = 2,           // AVX-512F
+  ANNOY_ISA_AVX512_VPOPCNTDQ = 3, // AVX-512F + VPOPCNTDQ
+  ANNOY_ISA_MAX = ANNOY_ISA_AVX512_VPOPCNTDQ
+};
 
-    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T norm = sqrt(dot(node->v, node->v, f));
-      if (isnan(norm)) norm = 0;
-      node->dot_factor = norm;
-    }
+inline int detect_isa() {
+  // Returns the best instruction set supported by both this build and the host.
+#ifdef ANNOY_RUNTIME_DISPATCH
+  __builtin_cpu_init(); // Static binaries may get here before libgcc initialized the cpu model
+#ifdef USE_AVX512_VPOPCNTDQ
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+    return ANNOY_ISA_AVX512_VPOPCNTDQ;
+#endif
+  if (__builtin_cpu_supports("avx512f"))
+    return ANNOY_ISA_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("popcnt") &&
+      __builtin_cpu_supports("f16c"))
+    return ANNOY_ISA_AVX2;
+  return ANNOY_ISA_SCALAR;
+#elif defined(USE_AVX512_VPOPCNTDQ)
+  return ANNOY_ISA_AVX512_VPOPCNTDQ;
+#elif defined(USE_AVX512)
+  return ANNOY_ISA_AVX512;
+#elif defined(USE_AVX2)
+  return ANNOY_ISA_AVX2;
+#else
+  return ANNOY_ISA_SCALAR;
+#endif
+}
 
-    // Step two: find the maximum norm
-    T max_norm = 0;
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      if (node->dot_factor > max_norm) {
-        max_norm = node->dot_factor;
-      }
-    }
+template<typename T>
+struct DistanceKernels {
+  /*
+   * One implementation of every vector kernel for a given element type, all
+   * compiled for the same instruction set. The metrics below never call the
+   * implementations directly; they go through Kernels<T>::get().
+   */
+  const char* name;
+  T (*dot)(const T* x, const T* y, int f);
+  T (*manhattan_distance)(const T* x, const T* y, int f);
+  T (*euclidean_distance)(const T* x, const T* y, int f);
+  // One-to-many versions: out[i] = kernel(x, ys[i], f) for i < n
+  void (*dot_many)(const T* x, const T* const* ys, size_t n, int f, T* out);
+  void (*manhattan_distance_many)(const T* x, const T* const* ys, size_t n, int f, T* out);
+  void (*euclidean_distance_many)(const T* x, const T* const* ys, size_t n, int f, T* out);
+  // y = a * x + b * y
+  void (*axpby)(T a, const T* x, T b, T* y, int f);
+  // Bit kernels for Hamming. Only set for integer element types
+  T (*hamming_distance)(const T* x, const T* y, int f);
+  void (*hamming_distance_many)(const T* x, const T* const* ys, size_t n, int f, T* out);
+  void (*bit_occupancy)(const T* const* vs, size_t n, int f, T* any, T* all);
+};
 
-    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T node_norm = node->dot_factor;
+template<typename T, bool is_integer=numeric_limits<T>::is_integer>
+struct ScalarKernels {
+  static const DistanceKernels<T> table;
+};
 
-      T dot_factor = sqrt(pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0)));
-      if (isnan(dot_factor)) dot_factor = 0;
+template<typename T, bool is_integer>
+const DistanceKernels<T> ScalarKernels<T, is_integer>::table = {
+  "scalar",
+  &dot_scalar<T>,
+  &manhattan_distance_scalar<T>,
+  &euclidean_distance_scalar<T>,
+  &dot_many_scalar<T>,
+  &manhattan_distance_many_scalar<T>,
+  &euclidean_distance_many_scalar<T>,
+  &axpby_scalar<T>,
+  NULL,
+  NULL,
+  NULL
+};
 
-      node->dot_factor = dot_factor;
-    }
-  }
+template<typename T>
+struct ScalarKernels<T, true> {
+  static const DistanceKernels<T> table;
 };
 
-struct Hamming : Base {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    S n_descendants;
-    S children[2];
-    T v[1];
+template<typename T>
+const DistanceKernels<T> ScalarKernels<T, true>::table = {
+  "scalar",
+  &dot_scalar<T>,
+  &manhattan_distance_scalar<T>,
+  &euclidean_distance_scalar<T>,
+  &dot_many_scalar<T>,
+  &manhattan_distance_many_scalar<T>,
+  &euclidean_distance_many_scalar<T>,
+  &axpby_scalar<T>,
+  &hamming_distance_scalar<T>,
+  &hamming_distance_many_scalar<T>,
+  &bit_occupancy_scalar<T>
+};
+
+template<typename T>
+inline const DistanceKernels<T>* isa_kernels(int) {
+  // Element types without vectorized kernels always run the scalar ones.
+  return &ScalarKernels<T>::table;
+}
+
+#ifdef USE_AVX2
+template<>
+inline const DistanceKernels<float>* isa_kernels<float>(int isa) {
+#ifdef USE_AVX512
+  static const DistanceKernels<float> avx512 = {
+    "avx512", &dot_avx512, &manhattan_distance_avx512, &euclidean_distance_avx512,
+    &distance_many_avx512<DotOp>, &distance_many_avx512<ManhattanOp>, &distance_many_avx512<EuclideanOp>,
+    &axpby_avx512, NULL, NULL, NULL
   };
+  if (isa >= ANNOY_ISA_AVX512)
+    return &avx512;
+#endif
+  static const DistanceKernels<float> avx2 = {
+    "avx2+fma", &dot_avx2, &manhattan_distance_avx2, &euclidean_distance_avx2,
+    &distance_many_avx2<DotOp>, &distance_many_avx2<ManhattanOp>, &distance_many_avx2<EuclideanOp>,
+    &axpby_avx2, NULL, NULL, NULL
+  };
+  if (isa >= ANNOY_ISA_AVX2)
+    return &avx2;
+  return &ScalarKernels<float>::table;
+}
 
-  static const size_t max_iterations = 20;
+template<>
+inline const DistanceKernels<double>* isa_kernels<double>(int isa) {
+#ifdef USE_AVX512
+  static const DistanceKernels<double> avx512 = {
+    "avx512", &dot_avx512, &manhattan_distance_avx512, &euclidean_distance_avx512,
+    &distance_many_avx512<DotOp>, &distance_many_avx512<ManhattanOp>, &distance_many_avx512<EuclideanOp>,
+    &axpby_avx512, NULL, NULL, NULL
+  };
+  if (isa >= ANNOY_ISA_AVX512)
+    return &avx512;
+#endif
+  static const DistanceKernels<double> avx2 = {
+    "avx2+fma", &dot_avx2, &manhattan_distance_avx2, &euclidean_distance_avx2,
+    &distance_many_avx2<DotOp>, &distance_many_avx2<ManhattanOp>, &distance_many_avx2<EuclideanOp>,
+    &axpby_avx2, NULL, NULL, NULL
+  };
+  if (isa >= ANNOY_ISA_AVX2)
+    return &avx2;
+  return &ScalarKernels<double>::table;
+}
 
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    return distance - (margin != (unsigned int) child_nr);
+template<>
+inline const DistanceKernels<uint64_t>* isa_kernels<uint64_t>(int isa) {
+  // Only the Hamming kernels are vectorized for uint64_t
+#ifdef USE_AVX512_VPOPCNTDQ
+  static const DistanceKernels<uint64_t> avx512 = {
+    "avx512-vpopcntdq",
+    &dot_scalar<uint64_t>, &manhattan_distance_scalar<uint64_t>, &euclidean_distance_scalar<uint64_t>,
+    &dot_many_scalar<uint64_t>, &manhattan_distance_many_scalar<uint64_t>, &euclidean_distance_many_scalar<uint64_t>,
+    &axpby_scalar<uint64_t>,
+    &hamming_distance_avx512, &hamming_distance_many_avx512, &bit_occupancy_avx512
+  };
+  if (isa >= ANNOY_ISA_AVX512_VPOPCNTDQ)
+    return &avx512;
+#endif
+  static const DistanceKernels<uint64_t> avx2 = {
+    "avx2-harley-seal",
+    &dot_scalar<uint64_t>, &manhattan_distance_scalar<uint64_t>, &euclidean_distance_scalar<uint64_t>,
+    &dot_many_scalar<uint64_t>, &manhattan_distance_many_scalar<uint64_t>, &euclidean_distance_many_scalar<uint64_t>,
+    &axpby_scalar<uint64_t>,
+    &hamming_distance_avx2, &hamming_distance_many_avx2, &bit_occupancy_avx2
+  };
+  if (isa >= ANNOY_ISA_AVX2)
+    return &avx2;
+  return &ScalarKernels<uint64_t>::table;
+}
+#endif
+
+template<typename T>
+inline const DistanceKernels<T>* fixed_dim_kernels(int, int) {
+  // Kernels specialized for vectors of exactly f elements, or NULL if there
+  // are none for this element type, dimension and instruction set.
+  return NULL;
+}
+
+#ifdef USE_AVX2
+template<typename T, int F>
+inline const DistanceKernels<T>* fixed_dim_table(int isa, const char* avx512_name, const char* avx2_name) {
+#ifdef USE_AVX512
+  static const DistanceKernels<T> avx512 = {
+    avx512_name,
+    &distance_fixed_avx512<DotOp, F>, &distance_fixed_avx512<ManhattanOp, F>, &distance_fixed_avx512<EuclideanOp, F>,
+    &distance_many_avx512<DotOp, F>, &distance_many_avx512<ManhattanOp, F>, &distance_many_avx512<EuclideanOp, F>,
+    &axpby_avx512, NULL, NULL, NULL
+  };
+  if (isa >= ANNOY_ISA_AVX512)
+    return &avx512;
+#endif
+  static const DistanceKernels<T> avx2 = {
+    avx2_name,
+    &distance_fixed_avx2<DotOp, F>, &distance_fixed_avx2<ManhattanOp, F>, &distance_fixed_avx2<EuclideanOp, F>,
+    &distance_many_avx2<DotOp, F>, &distance_many_avx2<ManhattanOp, F>, &distance_many_avx2<EuclideanOp, F>,
+    &axpby_avx2, NULL, NULL, NULL
+  };
+  if (isa >= ANNOY_ISA_AVX2)
+    return &avx2;
+  return NULL;
+}
+
+template<typename T>
+inline const DistanceKernels<T>* common_dim_kernels(int isa, int f) {
+  // The common embedding sizes
+  switch (f) {
+  case 64: return fixed_dim_table<T, 64>(isa, "avx512/64", "avx2+fma/64");
+  case 96: return fixed_dim_table<T, 96>(isa, "avx512/96", "avx2+fma/96");
+  case 100: return fixed_dim_table<T, 100>(isa, "avx512/100", "avx2+fma/100");
+  case 128: return fixed_dim_table<T, 128>(isa, "avx512/128", "avx2+fma/128");
+  case 256: return fixed_dim_table<T, 256>(isa, "avx512/256", "avx2+fma/256");
+  case 768: return fixed_dim_table<T, 768>(isa, "avx512/768", "avx2+fma/768");
   }
+  return NULL;
+}
 
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::max();
+template<>
+inline const DistanceKernels<float>* fixed_dim_kernels<float>(int isa, int f) {
+  return common_dim_kernels<float>(isa, f);
+}
+
+template<>
+inline const DistanceKernels<double>* fixed_dim_kernels<double>(int isa, int f) {
+  return common_dim_kernels<double>(isa, f);
+}
+#endif
+
+template<typename T>
+struct Kernels {
+  // The kernels to run on vectors of f elements: the ones specialized for f
+  // if there are any, else the best ones the host supports. The table is
+  // built once, on first use (C++11 makes that thread safe), and never
+  // changes after, so indexes of any dimension can run side by side.
+  enum { max_fixed_f = 768 }; // The largest dimension with specialized kernels
+
+  const DistanceKernels<T>* active;
+  const DistanceKernels<T>* by_dim[max_fixed_f + 1];
+
+  explicit Kernels(int isa) {
+    active = isa_kernels<T>(isa);
+    for (int f = 0; f <= max_fixed_f; f++) {
+      by_dim[f] = fixed_dim_kernels<T>(isa, f);
+      if (!by_dim[f])
+        by_dim[f] = active;
+    }
   }
-  template<typename T>
-  static inline int cole_popcount(T v) {
-    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
-    // calculate std::bitset::count for v > 32bit. Uses the generalized
-    // approach by Eric Cole.
-    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
-    v = v - ((v >> 1) & (T)~(T)0/3);
-    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
-    v = (v + (v >> 4)) & (T)~(T)0/255*15;
-    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
+
+  static const Kernels& table() {
+    static const Kernels kernels(detect_isa());
+    return kernels;
   }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    size_t dist = 0;
-    for (int i = 0; i < f; i++) {
-      dist += popcount(x->v[i] ^ y->v[i]);
-    }
-    return dist;
+
+  static inline const DistanceKernels<T>* get(int f) {
+    const Kernels& k = table();
+    return f <= max_fixed_f ? k.by_dim[f] : k.active;
   }
-  template<typename S, typename T>
-  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
-    static const size_t n_bits = sizeof(T) * 8;
-    T chunk = n->v[0] / n_bits;
-    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
+};
+
+template<typename T>
+inline T dot(const T* x, const T* y, int f) {
+  return Kernels<T>::get(f)->dot(x, y, f);
+}
+
+template<typename T>
+inline T manhattan_distance(const T* x, const T* y, int f) {
+  return Kernels<T>::get(f)->manhattan_distance(x, y, f);
+}
+
+template<typename T>
+inline T euclidean_distance(const T* x, const T* y, int f) {
+  return Kernels<T>::get(f)->euclidean_distance(x, y, f);
+}
+
+template<typename T>
+inline void dot_many(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  Kernels<T>::get(f)->dot_many(x, ys, n, f, out);
+}
+
+template<typename T>
+inline void manhattan_distance_many(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  Kernels<T>::get(f)->manhattan_distance_many(x, ys, n, f, out);
+}
+
+template<typename T>
+inline void euclidean_distance_many(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  Kernels<T>::get(f)->euclidean_distance_many(x, ys, n, f, out);
+}
+
+template<typename T>
+inline void axpby(T a, const T* x, T b, T* y, int f) {
+  Kernels<T>::get(f)->axpby(a, x, b, y, f);
+}
+
+template<typename T>
+inline T hamming_distance(const T* x, const T* y, int f) {
+  return Kernels<T>::get(f)->hamming_distance(x, y, f);
+}
+
+template<typename T>
+inline void hamming_distance_many(const T* x, const T* const* ys, size_t n, int f, T* out) {
+  Kernels<T>::get(f)->hamming_distance_many(x, ys, n, f, out);
+}
+
+template<typename T>
+inline void bit_occupancy(const T* const* vs, size_t n, int f, T* any, T* all) {
+  Kernels<T>::get(f)->bit_occupancy(vs, n, f, any, all);
+}
+
+inline float half_to_float(uint16_t h) {
+  // Exact conversion, including subnormals, infinities and NaN
+  const uint32_t shifted_exp = 0x7c00 << 13;
+  uint32_t u = (uint32_t)(h & 0x7fff) << 13;
+  uint32_t exp = shifted_exp & u;
+  u += (127 - 15) << 23;
+  float x;
+  if (exp == shifted_exp) {
+    u += (128 - 16) << 23;
+    memcpy(&x, &u, sizeof(x));
+  } else if (exp == 0) {
+    const uint32_t magic_bits = 113 << 23;
+    float magic;
+    memcpy(&magic, &magic_bits, sizeof(magic));
+    u += 1 << 23;
+    memcpy(&x, &u, sizeof(x));
+    x -= magic; // Renormalize
+  } else {
+    memcpy(&x, &u, sizeof(x));
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    return margin(n, y, f);
+  memcpy(&u, &x, sizeof(u));
+  u |= (uint32_t)(h & 0x8000) << 16;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+inline uint16_t float_to_half(float x) {
+  // Rounds to nearest even. Values beyond the half range become infinity.
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  const uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+  uint16_t h;
+  if (u >= (127 + 16) << 23) {
+    h = (u > 0x7f800000u) ? 0x7e00 : 0x7c00; // NaN stays NaN
+  } else if (u < (113 << 23)) {
+    // Subnormal or zero: let the float adder do the rounding
+    const uint32_t magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+    float magic, y;
+    memcpy(&magic, &magic_bits, sizeof(magic));
+    memcpy(&y, &u, sizeof(y));
+    y += magic;
+    memcpy(&u, &y, sizeof(u));
+    h = (uint16_t)(u - magic_bits);
+  } else {
+    const uint32_t mant_odd = (u >> 13) & 1;
+    u += ((uint32_t)(15 - 127) << 23) + 0xfff + mant_odd;
+    h = (uint16_t)(u >> 13);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    size_t cur_size = 0;
-    size_t i = 0;
-    int dim = f * 8 * sizeof(T);
-    for (; i < max_iterations; i++) {
-      // choose random position to split at
-      n->v[0] = random.index(dim);
-      cur_size = 0;
-      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-        if (margin(n, (*it)->v, f)) {
-          cur_size++;
-        }
-      }
-      if (cur_size > 0 && cur_size < nodes.size()) {
-        break;
-      }
-    }
-    // brute-force search for splitting coordinate
-    if (i == max_iterations) {
-      int j = 0;
-      for (; j < dim; j++) {
-        n->v[0] = j;
-        cur_size = 0;
-        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-          if (margin(n, (*it)->v, f)) {
-            cur_size++;
-          }
-        }
-        if (cur_size > 0 && cur_size < nodes.size()) {
-          break;
-        }
-      }
-    }
+  return h | (uint16_t)(sign >> 16);
+}
+
+inline float bfloat16_to_float(uint16_t b) {
+  uint32_t u = (uint32_t)b << 16;
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+inline uint16_t float_to_bfloat16(float x) {
+  // Rounds to nearest even
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  if ((u & 0x7fffffffu) > 0x7f800000u)
+    return (uint16_t)((u >> 16) | 0x40); // Keep NaN quiet instead of rounding it to infinity
+  u += 0x7fff + ((u >> 16) & 1);
+  return (uint16_t)(u >> 16);
+}
+
+template<typename V>
+struct VectorStorage {
+  /*
+   * How the vector of a node is laid out in memory. By default the elements
+   * are stored as they are. The specializations below store them in reduced
+   * precision and can only be used with T = float.
+   */
+  static const bool exact = true;
+  static const size_t scale_size = 0;
+
+  static const char* name() {
+    return "native"; // As T
+  }
+  static size_t size(int f) {
+    return f * sizeof(V);
   }
   template<typename T>
-  static inline T normalized_distance(T distance) {
-    return distance;
+  static inline void encode(const T* x, int f, V* out) {
+    for (int z = 0; z < f; z++)
+      out[z] = x[z];
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  template<typename T>
+  static inline void decode(const V* x, int f, T* out) {
+    for (int z = 0; z < f; z++)
+      out[z] = x[z];
   }
+};
+
+template<>
+struct VectorStorage<Float16> {
+  static const bool exact = false;
+  static const size_t scale_size = 0;
+
   static const char* name() {
-    return "hamming";
+    return "float16";
+  }
+  static size_t size(int f) {
+    return f * sizeof(Float16);
+  }
+  template<typename T>
+  static inline void encode(const T* x, int f, Float16* out) {
+    for (int z = 0; z < f; z++)
+      out[z].bits = float_to_half(x[z]);
+  }
+  template<typename T>
+  static inline void decode(const Float16* x, int f, T* out) {
+    for (int z = 0; z < f; z++)
+      out[z] = half_to_float(x[z].bits);
+  }
+  static inline float widen(Float16 y) {
+    return half_to_float(y.bits);
+  }
+  static inline float scale(const Float16*, int) {
+    return 1.0f;
   }
 };
 
+template<>
+struct VectorStorage<BFloat16> {
+  static const bool exact = false;
+  static const size_t scale_size = 0;
 
-struct Minkowski : Base {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    S n_descendants;
-    T a; // need an extra constant term to determine the offset of the plane
-    S children[2];
-    T v[1];
-  };
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return n->a + dot(n->v, y, f);
+  static const char* name() {
+    return "bfloat16";
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return random.flip();
+  static size_t size(int f) {
+    return f * sizeof(BFloat16);
   }
   template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
+  static inline void encode(const T* x, int f, BFloat16* out) {
+    for (int z = 0; z < f; z++)
+      out[z].bits = float_to_bfloat16(x[z]);
   }
   template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+  static inline void decode(const BFloat16* x, int f, T* out) {
+    for (int z = 0; z < f; z++)
+      out[z] = bfloat16_to_float(x[z].bits);
+  }
+  static inline float widen(BFloat16 y) {
+    return bfloat16_to_float(y.bits);
+  }
+  static inline float scale(const BFloat16*, int) {
+    return 1.0f;
   }
 };
 
+template<>
+struct VectorStorage<ScaledInt8> {
+  static const bool exact = false;
+  static const size_t scale_size = sizeof(float); // The scale, stored after the codes
 
-struct Euclidean : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return euclidean_distance(x->v, y->v, f);    
+  static const char* name() {
+    return "int8";
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
-
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
+  static size_t size(int f) {
+    return f * sizeof(ScaledInt8) + scale_size;
+  }
+  template<typename T>
+  static inline void encode(const T* x, int f, ScaledInt8* out) {
+    float max_abs = 0;
     for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+      max_abs = std::max(max_abs, (float)fabs(x[z]));
+    float s = max_abs / 127;
+    for (int z = 0; z < f; z++) {
+      float c = s > 0 ? (float)x[z] / s : 0.0f;
+      c = std::max(-127.0f, std::min(127.0f, c));
+      out[z].code = (int8_t)(c < 0 ? c - 0.5f : c + 0.5f);
+    }
+    memcpy(out + f, &s, sizeof(s)); // The scale is not aligned
   }
   template<typename T>
-  static inline T normalized_distance(T distance) {
-    return sqrt(std::max(distance, T(0)));
+  static inline void decode(const ScaledInt8* x, int f, T* out) {
+    float s = scale(x, f);
+    for (int z = 0; z < f; z++)
+      out[z] = x[z].code * s;
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  static inline float widen(ScaledInt8 y) {
+    return y.code;
   }
-  static const char* name() {
-    return "euclidean";
+  static inline float scale(const ScaledInt8* y, int f) {
+    float s;
+    memcpy(&s, y + f, sizeof(s));
+    return s;
+  }
+};
+
+template<typename V, typename R, bool exact=VectorStorage<V>::exact>
+struct IfReduced {
+  // IfReduced<V, R>::type is R if V is a reduced precision type, and doesn't
+  // exist otherwise. Keeps the overloads below from matching plain T* vectors.
+};
+
+template<typename V, typename R>
+struct IfReduced<V, R, false> {
+  typedef R type;
+};
+
+template<typename V, typename T>
+inline void encode_vector(const T* x, int f, V* out) {
+  VectorStorage<V>::encode(x, f, out);
+}
+
+template<typename T, typename V>
+inline void decode_vector(const V* x, int f, T* out) {
+  VectorStorage<V>::decode(x, f, out);
+}
+
+template<typename V>
+inline typename IfReduced<V, void>::type decode_vector(const V* x, int f, float* out); // Vectorized, see below
+
+template<typename T, typename V>
+inline const T* vector_view(const V* x, int f, T* buf) {
+  // Full precision view of a stored vector; buf must hold f elements
+  decode_vector(x, f, buf);
+  return buf;
+}
+
+template<typename T>
+inline const T* vector_view(const T* x, int, T*) {
+  return x;
+}
+
+template<typename V>
+inline void widen_scalar(const V* y, int f, float* out) {
+  VectorStorage<V>::decode(y, f, out);
+}
+
+template<typename V>
+inline float dot_widen_scalar(const float* x, const V* y, int f) {
+  float d = 0;
+  for (int z = 0; z < f; z++)
+    d += x[z] * VectorStorage<V>::widen(y[z]);
+  return d * VectorStorage<V>::scale(y, f);
+}
+
+template<typename V>
+inline float manhattan_distance_widen_scalar(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float d = 0;
+  for (int z = 0; z < f; z++)
+    d += fabs(x[z] - s * VectorStorage<V>::widen(y[z]));
+  return d;
+}
+
+template<typename V>
+inline float euclidean_distance_widen_scalar(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float d = 0;
+  for (int z = 0; z < f; z++) {
+    const float tmp = x[z] - s * VectorStorage<V>::widen(y[z]);
+    d += tmp * tmp;
+  }
+  return d;
+}
+
+#ifdef USE_AVX2
+template<typename V>
+struct WidenSimd {
+  // load8()/load16() widen the next 8/16 stored elements to float
+};
+
+template<>
+struct WidenSimd<Float16> {
+  ANNOY_TARGET_AVX2
+  static inline __m256 load8(const Float16* y) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)y));
+  }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512
+  static inline __m512 load16(const Float16* y) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)y));
+  }
+#endif
+};
+
+template<>
+struct WidenSimd<BFloat16> {
+  ANNOY_TARGET_AVX2
+  static inline __m256 load8(const BFloat16* y) {
+    const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)y));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+  }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512
+  static inline __m512 load16(const BFloat16* y) {
+    const __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)y));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+  }
+#endif
+};
+
+template<>
+struct WidenSimd<ScaledInt8> {
+  // The codes are widened as is; the kernels apply the scale
+  ANNOY_TARGET_AVX2
+  static inline __m256 load8(const ScaledInt8* y) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)y)));
+  }
+#ifdef USE_AVX512
+  ANNOY_TARGET_AVX512
+  static inline __m512 load16(const ScaledInt8* y) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)y)));
+  }
+#endif
+};
+
+template<typename V>
+ANNOY_TARGET_AVX2
+inline void widen_avx2(const V* y, int f, float* out) {
+  const float s = VectorStorage<V>::scale(y, f);
+  const __m256 scale = _mm256_set1_ps(s);
+  int i = f;
+  for (; i > 7; i -= 8) {
+    _mm256_storeu_ps(out, _mm256_mul_ps(scale, WidenSimd<V>::load8(y)));
+    out += 8;
+    y += 8;
+  }
+  for (; i > 0; i--)
+    *out++ = s * VectorStorage<V>::widen(*y++);
+}
+
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float dot_widen_avx2(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; i > 7; i -= 8) {
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), WidenSimd<V>::load8(y), d);
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx(d);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += *x * VectorStorage<V>::widen(*y);
+    x++;
+    y++;
+  }
+  return result * s;
+}
+
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float manhattan_distance_widen_avx2(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    const __m256 scale = _mm256_set1_ps(s);
+    for (; i > 7; i -= 8) {
+      const __m256 x_minus_y = _mm256_fnmadd_ps(scale, WidenSimd<V>::load8(y), _mm256_loadu_ps(x));
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, x_minus_y));
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx(manhattan);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += fabsf(*x - s * VectorStorage<V>::widen(*y));
+    x++;
+    y++;
+  }
+  return result;
+}
+
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float euclidean_distance_widen_avx2(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    const __m256 scale = _mm256_set1_ps(s);
+    for (; i > 7; i -= 8) {
+      const __m256 diff = _mm256_fnmadd_ps(scale, WidenSimd<V>::load8(y), _mm256_loadu_ps(x));
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx(d);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    float tmp = *x - s * VectorStorage<V>::widen(*y);
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+#ifdef USE_AVX512
+template<typename V>
+ANNOY_TARGET_AVX512
+inline void widen_avx512(const V* y, int f, float* out) {
+  const float s = VectorStorage<V>::scale(y, f);
+  const __m512 scale = _mm512_set1_ps(s);
+  int i = f;
+  for (; i > 15; i -= 16) {
+    _mm512_storeu_ps(out, _mm512_mul_ps(scale, WidenSimd<V>::load16(y)));
+    out += 16;
+    y += 16;
+  }
+  for (; i > 0; i--)
+    *out++ = s * VectorStorage<V>::widen(*y++);
+}
+
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float dot_widen_avx512(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; i > 15; i -= 16) {
+      d = _mm512_fmadd_ps(_mm512_loadu_ps(x), WidenSimd<V>::load16(y), d);
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += *x * VectorStorage<V>::widen(*y);
+    x++;
+    y++;
+  }
+  return result * s;
+}
+
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float manhattan_distance_widen_avx512(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    const __m512 scale = _mm512_set1_ps(s);
+    for (; i > 15; i -= 16) {
+      const __m512 x_minus_y = _mm512_fnmadd_ps(scale, WidenSimd<V>::load16(y), _mm512_loadu_ps(x));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(x_minus_y));
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += fabsf(*x - s * VectorStorage<V>::widen(*y));
+    x++;
+    y++;
+  }
+  return result;
+}
+
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float euclidean_distance_widen_avx512(const float* x, const V* y, int f) {
+  const float s = VectorStorage<V>::scale(y, f);
+  float result = 0;
+  int i = f;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    const __m512 scale = _mm512_set1_ps(s);
+    for (; i > 15; i -= 16) {
+      const __m512 diff = _mm512_fnmadd_ps(scale, WidenSimd<V>::load16(y), _mm512_loadu_ps(x));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    float tmp = *x - s * VectorStorage<V>::widen(*y);
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+#endif
+#endif
+
+template<typename V>
+struct WideningKernels {
+  // Kernels between a float vector and a vector stored as V
+  const char* name;
+  void (*widen)(const V* y, int f, float* out);
+  float (*dot)(const float* x, const V* y, int f);
+  float (*manhattan_distance)(const float* x, const V* y, int f);
+  float (*euclidean_distance)(const float* x, const V* y, int f);
+};
+
+template<typename V>
+struct ScalarWideningKernels {
+  static const WideningKernels<V> table;
+};
+
+template<typename V>
+const WideningKernels<V> ScalarWideningKernels<V>::table = {
+  "scalar",
+  &widen_scalar<V>,
+  &dot_widen_scalar<V>,
+  &manhattan_distance_widen_scalar<V>,
+  &euclidean_distance_widen_scalar<V>
+};
+
+template<typename V>
+inline const WideningKernels<V>* widening_kernels(int isa) {
+#ifdef USE_AVX512
+  static const WideningKernels<V> avx512 = {
+    "avx512", &widen_avx512<V>, &dot_widen_avx512<V>, &manhattan_distance_widen_avx512<V>, &euclidean_distance_widen_avx512<V>
+  };
+  if (isa >= ANNOY_ISA_AVX512)
+    return &avx512;
+#endif
+#ifdef USE_AVX2
+  static const WideningKernels<V> avx2 = {
+    "avx2+fma", &widen_avx2<V>, &dot_widen_avx2<V>, &manhattan_distance_widen_avx2<V>, &euclidean_distance_widen_avx2<V>
+  };
+  if (isa >= ANNOY_ISA_AVX2)
+    return &avx2;
+#endif
+  return &ScalarWideningKernels<V>::table;
+}
+
+template<typename V>
+struct Widening {
+  // Same as Kernels<T>, for the kernels reading vectors stored as V
+  static inline const WideningKernels<V>* get() {
+    static const WideningKernels<V>* const kernels = widening_kernels<V>(detect_isa());
+    return kernels;
+  }
+};
+
+// The overloads below let the metrics mix full precision and stored vectors,
+// in either order. T is always float in that case.
+template<typename V>
+inline typename IfReduced<V, void>::type decode_vector(const V* x, int f, float* out) {
+  Widening<V>::get()->widen(x, f, out);
+}
+
+template<typename V>
+inline typename IfReduced<V, float>::type dot(const float* x, const V* y, int f) {
+  return Widening<V>::get()->dot(x, y, f);
+}
+
+template<typename V>
+inline typename IfReduced<V, float>::type dot(const V* x, const float* y, int f) {
+  return Widening<V>::get()->dot(y, x, f);
+}
+
+template<typename V>
+inline typename IfReduced<V, float>::type manhattan_distance(const float* x, const V* y, int f) {
+  return Widening<V>::get()->manhattan_distance(x, y, f);
+}
+
+template<typename V>
+inline typename IfReduced<V, float>::type euclidean_distance(const float* x, const V* y, int f) {
+  return Widening<V>::get()->euclidean_distance(x, y, f);
+}
+
+template<typename V>
+inline typename IfReduced<V, void>::type dot_many(const float* x, const V* const* ys, size_t n, int f, float* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = dot(x, ys[i], f);
+}
+
+template<typename V>
+inline typename IfReduced<V, void>::type manhattan_distance_many(const float* x, const V* const* ys, size_t n, int f, float* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = manhattan_distance(x, ys[i], f);
+}
+
+template<typename V>
+inline typename IfReduced<V, void>::type euclidean_distance_many(const float* x, const V* const* ys, size_t n, int f, float* out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = euclidean_distance(x, ys[i], f);
+}
+
+template<typename T>
+inline T squared_norm(const T* x, int f) {
+  return dot(x, x, f);
+}
+
+template<typename T, typename V>
+inline typename IfReduced<V, T>::type squared_norm(const V* x, int f) {
+  const T s = VectorStorage<V>::scale(x, f);
+  T d = 0;
+  for (int z = 0; z < f; z++)
+    d += VectorStorage<V>::widen(x[z]) * VectorStorage<V>::widen(x[z]);
+  return d * s * s;
+}
+
+#ifdef USE_AVX2
+ANNOY_TARGET_AVX2
+inline void fast_scan_avx2(const uint8_t* block, const uint8_t* lut, int m, uint16_t* out) {
+  // Sums the 4-bit lookup table entries of the 32 items of one block of
+  // interleaved product quantization codes (see ProductQuantizer). One byte
+  // shuffle looks up subspace j for all 32 items at once.
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_setzero_si256(); // Items 0-15
+  __m256i hi = _mm256_setzero_si256(); // Items 16-31
+  for (int j = 0; j < m; j++) {
+    const __m128i codes = _mm_loadu_si128((const __m128i*)(block + 16 * j));
+    const __m256i c = _mm256_and_si256(_mm256_set_m128i(_mm_srli_epi16(codes, 4), codes), low_mask);
+    const __m256i t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * j)));
+    const __m256i d = _mm256_shuffle_epi8(t, c);
+    lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(d)));
+    hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1)));
+  }
+  _mm256_storeu_si256((__m256i*)out, lo);
+  _mm256_storeu_si256((__m256i*)(out + 16), hi);
+}
+#endif
+
+typedef void (*fast_scan_fn)(const uint8_t* block, const uint8_t* lut, int m, uint16_t* out);
+
+inline fast_scan_fn fast_scan_kernel() {
+  // NULL if there is nothing faster than looking up the items one by one
+#ifdef USE_AVX2
+  static const int host_isa = detect_isa();
+  if (host_isa >= ANNOY_ISA_AVX2)
+    return &fast_scan_avx2;
+#endif
+  return NULL;
+}
+
+template<typename T>
+inline T get_norm(const T* v, int f) {
+  return sqrt(dot(v, v, f));
+}
+
+struct SplitOptions {
+  // How two_means() samples the points, see AnnoyIndex::set_split_options()
+  int iterations; // Number of centroid updates
+  int sample_size; // Points assigned per update, 1 for the classic algorithm
+  SplitOptions() : iterations(200), sample_size(1) {}
+};
+
+template<typename T, typename Random, typename Distance, typename Node, typename StoredNode>
+inline void two_means_mini_batch(const vector<StoredNode*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q,
+                                 const SplitOptions& options) {
+  // The loop of two_means() below, but every update assigns a sample of
+  // points, scored against both centroids with the one-to-many kernels, and
+  // moves each centroid once to the weighted mean of its old position and its
+  // new points: c = (ic * c + sum of v) / (ic + n), one axpby() per point.
+  const size_t count = nodes.size();
+  const size_t b = options.sample_size;
+  T* buf = (T*)alloca(f * sizeof(T)); // Only used if the nodes store reduced precision vectors
+  const StoredNode** sample = (const StoredNode**)alloca(b * sizeof(StoredNode*));
+  T* dp = (T*)alloca(2 * b * sizeof(T));
+  T* dq = dp + b;
+  signed char* side = (signed char*)alloca(b);
+
+  int ic = 1, jc = 1;
+  for (int l = 0; l < options.iterations; l++) {
+    for (size_t k = 0; k < b; k++)
+      sample[k] = nodes[random.index(count)];
+    Distance::distance_many(p, sample, b, f, dp);
+    Distance::distance_many(q, sample, b, f, dq);
+    int np = 0, nq = 0;
+    for (size_t k = 0; k < b; k++) {
+      const T di = ic * dp[k], dj = jc * dq[k];
+      side[k] = (di < dj) ? 0 : (dj < di) ? 1 : -1;
+      T norm = 1.0;
+      if (cosine && side[k] >= 0)
+        norm = get_norm(vector_view(sample[k]->data(), f, buf), f);
+      if (!(norm > T(0)))
+        side[k] = -1;
+      dp[k] = T(1) / norm; // dp is free now, keep the weight of the point
+      np += (side[k] == 0);
+      nq += (side[k] == 1);
+    }
+    T ap = T(ic) / (ic + np), aq = T(jc) / (jc + nq); // Applied to the centroid with its first point
+    for (size_t k = 0; k < b; k++) {
+      if (side[k] < 0)
+        continue;
+      const T* v = vector_view(sample[k]->data(), f, buf);
+      if (side[k] == 0) {
+        axpby(dp[k] / (ic + np), v, ap, p->data(), f);
+        ap = 1;
+      } else {
+        axpby(dp[k] / (jc + nq), v, aq, q->data(), f);
+        aq = 1;
+      }
+    }
+    if (np) {
+      Distance::init_node(p, f);
+      ic += np;
+    }
+    if (nq) {
+      Distance::init_node(q, f);
+      jc += nq;
+    }
+  }
+}
+
+template<typename T, typename Random, typename Distance, typename Node, typename StoredNode>
+inline void two_means(const vector<StoredNode*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q,
+                      const SplitOptions& options) {
+  /*
+    This algorithm is a huge heuristic. Empirically it works really well, but I
+    can't motivate it well. The basic idea is to keep two centroids and assign
+    points to either one of them. We weight each centroid by the number of points
+    assigned to it, so to balance it. 
+  */
+  size_t count = nodes.size();
+  T* buf = (T*)alloca(f * sizeof(T)); // Only used if the nodes store reduced precision vectors
+
+  size_t i = random.index(count);
+  size_t j = random.index(count-1);
+  j += (j >= i); // ensure that i != j
+
+  Distance::template copy_node<T, Node>(p, nodes[i], f);
+  Distance::template copy_node<T, Node>(q, nodes[j], f);
+
+  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
+  Distance::init_node(p, f);
+  Distance::init_node(q, f);
+
+  if (options.sample_size > 1) {
+    two_means_mini_batch<T, Random, Distance, Node, StoredNode>(nodes, f, random, cosine, p, q, options);
+    return;
+  }
+
+  int ic = 1, jc = 1;
+  for (int l = 0; l < options.iterations; l++) {
+    size_t k = random.index(count);
+    T di = ic * Distance::distance(p, nodes[k], f),
+      dj = jc * Distance::distance(q, nodes[k], f);
+    const T* v = vector_view(nodes[k]->data(), f, buf);
+    T norm = cosine ? get_norm(v, f) : 1.0;
+    if (!(norm > T(0))) {
+      continue;
+    }
+    if (di < dj) {
+      for (int z = 0; z < f; z++)
+        p->v[z] = (p->v[z] * ic + v[z] / norm) / (ic + 1);
+      Distance::init_node(p, f);
+      ic++;
+    } else if (dj < di) {
+      for (int z = 0; z < f; z++)
+        q->v[z] = (q->v[z] * jc + v[z] / norm) / (jc + 1);
+      Distance::init_node(q, f);
+      jc++;
+    }
+  }
+}
+
+} // namespace
+
+struct Base {
+  // distance_many() hands candidates to the kernels in batches of this size
+  enum { batch_size = 64 };
+
+  template<typename V, typename Node>
+  static inline size_t gather_vectors(const Node* const* nodes, size_t n, const V** vs) {
+    // Collects the vectors of (at most) the next batch of nodes
+    if (n > batch_size) n = batch_size;
+    for (size_t i = 0; i < n; i++)
+      vs[i] = nodes[i]->data();
+    return n;
+  }
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
+    // Override this in specific metric structs below if you need to do any pre-processing
+    // on the entire set of nodes passed into this index.
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    // Initialize any fields that require sane defaults within this node.
+  }
+
+  template<typename T, typename Node, typename StoredNode>
+  static inline void copy_node(Node* dest, const StoredNode* source, const int f) {
+    // Copies a stored vector into a full precision node
+    decode_vector(source->data(), f, dest->data());
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    T norm = get_norm(node->v, f);
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+    }
+  }
+
+  // Asymmetric distance computation for product quantized items: the distance
+  // from x to an item is adc_distance() of the sum over the subspaces of
+  // adc_term() between x and the item's centroid, with qq = |x|^2 and nn the
+  // squared norm of the reconstructed item. Items go through adc_prepare()
+  // before they are quantized.
+  template<typename T>
+  static inline T adc_term(const T* x, const T* c, int f) {
+    return euclidean_distance(x, c, f);
+  }
+  template<typename T>
+  static inline T adc_distance(T sum, T, T) {
+    return sum;
+  }
+  template<typename T>
+  static inline void adc_prepare(T*, int) {
+  }
+
+  // Hooks of the split policies (see RandomProjectionSplit and BalancedSplit).
+  // random_plane() sets a random direction, balance_split() moves the plane
+  // so that it splits the given nodes in half. By default planes stay put.
+  template<typename Node, typename Random>
+  static inline void random_plane(Node* n, int f, Random& random) {
+    // Entries of +-1/sqrt(f), a unit vector (Achlioptas, 2003)
+    const double x = 1.0 / sqrt((double)f);
+    for (int z = 0; z < f; z++)
+      n->v[z] = random.flip() ? x : -x;
+  }
+  template<typename Node, typename StoredNode>
+  static inline void balance_split(Node*, const StoredNode* const*, size_t, int) {
+  }
+};
+
+struct Angular : Base {
+  template<typename S, typename T, typename V=T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    /*
+     * We store a binary tree where each node has two things
+     * - A vector associated with it
+     * - Two children
+     * All nodes occupy the same amount of memory
+     * All nodes with n_descendants == 1 are leaf nodes.
+     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
+     * we skip the vector. Instead we store a list of all descendants. K is
+     * determined by the number of items that fits in the space of the vector.
+     * For nodes with n_descendants == 1 the vector is a data point.
+     * For nodes with n_descendants > K the vector is the normal of the split plane.
+     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
+     * more memory to be able to fit the vector outside
+     * The vector elements are stored as V, which is T unless the index uses
+     * reduced precision storage (see VectorStorage).
+     */
+    S n_descendants;
+    union {
+      S children[2]; // Will possibly store more than 2
+      T norm;
+    };
+    V v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
+    // Pointers to the packed fields, which GCC warns about taking directly
+    V* data() { return (V*)((char*)this + offsetof(Node, v)); }
+    const V* data() const { return (const V*)((const char*)this + offsetof(Node, v)); }
+    S* ids() { return (S*)((char*)this + offsetof(Node, children)); }
+    const S* ids() const { return (const S*)((const char*)this + offsetof(Node, children)); }
+  };
+  template<typename S, typename T, typename V>
+  static inline T distance(const Node<S, T>* x, const Node<S, T, V>* y, int f) {
+    // want to calculate (a/|a| - b/|b|)^2
+    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
+    // = 2 - 2cos
+    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
+    T qq = y->norm ? y->norm : squared_norm<T>(y->data(), f);
+    T pq = dot(x->v, y->v, f);
+    T ppqq = pp * qq;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0; // cos is 0
+  }
+  template<typename S, typename T, typename V>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T, V>* const* ys, size_t n, int f, T* out) {
+    // Same as distance(x, ys[i], f) for every i, but the dot products are batched
+    const V* vs[batch_size];
+    T pp = x->norm ? x->norm : dot(x->data(), x->data(), f);
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      dot_many(x->data(), vs, m, f, out + i);
+      for (size_t k = 0; k < m; k++) {
+        const Node<S, T, V>* y = ys[i + k];
+        T qq = y->norm ? y->norm : squared_norm<T>(y->data(), f);
+        T ppqq = pp * qq;
+        if (ppqq > 0) out[i + k] = 2.0 - 2.0 * out[i + k] / sqrt(ppqq);
+        else out[i + k] = 2.0;
+      }
+    }
+  }
+  template<typename S, typename T, typename U, typename V>
+  static inline T margin(const Node<S, T, U>* n, const V* y, int f) {
+    // Either the node or y is full precision, the other one may be stored
+    return dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename U, typename V, typename Random>
+  static inline bool side(const Node<S, T, U>* n, const V* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return random.flip();
+  }
+  template<typename S, typename T, typename V, typename Random>
+  static inline void create_split(const vector<Node<S, T, V>*>& nodes, int f, size_t s, Random& random, const SplitOptions& options, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q, options);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    // Used when requesting distances from Python layer
+    // Turns out sometimes the squared distance is -0.0
+    // so we have to make sure it's a positive number.
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+    n->norm = dot(n->v, n->v, f);
+  }
+  template<typename T>
+  static inline T adc_term(const T* x, const T* c, int f) {
+    return -dot(x, c, f);
+  }
+  template<typename T>
+  static inline T adc_distance(T sum, T qq, T nn) {
+    T qqnn = qq * nn;
+    if (qqnn > 0) return 2.0 + 2.0 * sum / sqrt(qqnn);
+    else return 2.0;
+  }
+  template<typename T>
+  static inline void adc_prepare(T* v, int f) {
+    T norm = get_norm(v, f);
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        v[z] /= norm;
+    }
+  }
+  template<typename S, typename T, typename V>
+  static inline void balance_split(Node<S, T>* n, const Node<S, T, V>* const* nodes, size_t count, int f) {
+    // The plane has to go through the origin, so instead of shifting it, tilt
+    // it towards the mean direction c of the nodes: y is on side 1 of
+    // n - t * c when n.y / c.y > t (for c.y > 0), so the median of these
+    // ratios splits the nodes in the half space of c in half.
+    T* c = (T*)alloca(f * sizeof(T));
+    T* buf = (T*)alloca(f * sizeof(T));
+    for (int z = 0; z < f; z++)
+      c[z] = 0;
+    for (size_t i = 0; i < count; i++)
+      axpby(T(1), vector_view(nodes[i]->v, f, buf), T(1), c, f);
+    T norm = get_norm(c, f);
+    if (!(norm > T(0)))
+      return;
+    for (int z = 0; z < f; z++)
+      c[z] /= norm;
+
+    vector<T> nc(count), cc(count);
+    const V* vs[batch_size];
+    for (size_t i = 0; i < count; i += batch_size) {
+      size_t m = gather_vectors(nodes + i, count - i, vs);
+      dot_many(n->v, vs, m, f, &nc[i]);
+      dot_many(c, vs, m, f, &cc[i]);
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (cc[i] > 0)
+        nc[k++] = nc[i] / cc[i];
+    }
+    if (k == 0)
+      return;
+    std::nth_element(nc.begin(), nc.begin() + k / 2, nc.begin() + k);
+    const T t = nc[k / 2];
+    for (int z = 0; z < f; z++)
+      n->v[z] -= t * c[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  static const char* name() {
+    return "angular";
+  }
+};
+
+
+struct NormalizedAngular : Angular {
+  /*
+   * Angular distance for indexes of unit vectors. init_node() normalizes in
+   * place, which the index applies to every item when it is added and to
+   * every query once, so distances and margins are a single dot product and
+   * the norm is never stored or recomputed: the norm slot of leaves is free.
+   * get_item() returns the normalized vectors.
+   */
+  template<typename S, typename T, typename V>
+  static inline T distance(const Node<S, T>* x, const Node<S, T, V>* y, int f) {
+    return 2.0 - 2.0 * dot(x->v, y->v, f);
+  }
+  template<typename S, typename T, typename V>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T, V>* const* ys, size_t n, int f, T* out) {
+    const V* vs[batch_size];
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      dot_many(x->v, vs, m, f, out + i);
+      for (size_t k = 0; k < m; k++)
+        out[i + k] = 2.0 - 2.0 * out[i + k];
+    }
+  }
+  template<typename S, typename T, typename V, typename Random>
+  static inline void create_split(const vector<Node<S, T, V>*>& nodes, int f, size_t s, Random& random, const SplitOptions& options, Node<S, T>* n) {
+    // The centroids are renormalized by init_node() when they move, so the
+    // sampled items need no normalization
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, NormalizedAngular, Node<S, T> >(nodes, f, random, false, p, q, options);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  static const char* name() {
+    return "normalized_angular";
+  }
+};
+
+
+struct DotProduct : Angular {
+  template<typename S, typename T, typename V=T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    /*
+     * This is an extension of the Angular node with an extra attribute for the scaled norm.
+     */
+    S n_descendants;
+    S children[2]; // Will possibly store more than 2
+    T dot_factor;
+    V v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
+    // Pointers to the packed fields, which GCC warns about taking directly
+    V* data() { return (V*)((char*)this + offsetof(Node, v)); }
+    const V* data() const { return (const V*)((const char*)this + offsetof(Node, v)); }
+    S* ids() { return (S*)((char*)this + offsetof(Node, children)); }
+    const S* ids() const { return (const S*)((const char*)this + offsetof(Node, children)); }
+  };
+
+  static const char* name() {
+    return "dot";
+  }
+  template<typename S, typename T, typename V>
+  static inline T distance(const Node<S, T>* x, const Node<S, T, V>* y, int f) {
+    return -dot(x->v, y->v, f);
+  }
+  template<typename S, typename T, typename V>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T, V>* const* ys, size_t n, int f, T* out) {
+    const V* vs[batch_size];
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      dot_many(x->data(), vs, m, f, out + i);
+      for (size_t k = 0; k < m; k++)
+        out[i + k] = -out[i + k];
+    }
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    dest->dot_factor = 0;
+  }
+
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+
+  template<typename T, typename Node, typename StoredNode>
+  static inline void copy_node(Node* dest, const StoredNode* source, const int f) {
+    decode_vector(source->data(), f, dest->data());
+    dest->dot_factor = source->dot_factor;
+  }
+
+  template<typename S, typename T, typename V, typename Random>
+  static inline void create_split(const vector<Node<S, T, V>*>& nodes, int f, size_t s, Random& random, const SplitOptions& options, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    DotProduct::zero_value(p); 
+    DotProduct::zero_value(q);
+    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q, options);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    n->dot_factor = p->dot_factor - q->dot_factor;
+    DotProduct::normalize<T, Node<S, T> >(n, f);
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+      node->dot_factor /= norm;
+    }
+  }
+
+  template<typename S, typename T, typename U, typename V>
+  static inline T margin(const Node<S, T, U>* n, const V* y, int f) {
+    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  }
+
+  template<typename S, typename T, typename U, typename V, typename Random>
+  static inline bool side(const Node<S, T, U>* n, const V* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return random.flip();
+  }
+
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return -distance;
+  }
+
+  template<typename T>
+  static inline T adc_distance(T sum, T, T) {
+    return sum;
+  }
+
+  template<typename T>
+  static inline void adc_prepare(T*, int) {
+  }
+
+  template<typename Node, typename StoredNode>
+  static inline void balance_split(Node*, const StoredNode* const*, size_t, int) {
+    // The dot_factor term of the margin doesn't tilt with the plane, so the
+    // planes stay where they are
+  }
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
+    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
+    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+
+    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      T norm = sqrt(squared_norm<T>(node->data(), f));
+      if (isnan(norm)) norm = 0;
+      node->dot_factor = norm;
+    }
+
+    // Step two: find the maximum norm
+    T max_norm = 0;
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      if (node->dot_factor > max_norm) {
+        max_norm = node->dot_factor;
+      }
+    }
+
+    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      T node_norm = node->dot_factor;
+
+      T dot_factor = sqrt(pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0)));
+      if (isnan(dot_factor)) dot_factor = 0;
+
+      node->dot_factor = dot_factor;
+    }
+  }
+};
+
+struct Hamming : Base {
+  template<typename S, typename T, typename V=T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    S n_descendants;
+    S children[2];
+    V v[1]; // Always stored as T, there is no reduced precision for bits
+    // Pointers to the packed fields, which GCC warns about taking directly
+    V* data() { return (V*)((char*)this + offsetof(Node, v)); }
+    const V* data() const { return (const V*)((const char*)this + offsetof(Node, v)); }
+    S* ids() { return (S*)((char*)this + offsetof(Node, children)); }
+    const S* ids() const { return (const S*)((const char*)this + offsetof(Node, children)); }
+  };
+
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    return distance - (margin != (unsigned int) child_nr);
+  }
+
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::max();
+  }
+  template<typename T>
+  static inline int cole_popcount(T v) {
+    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
+    // calculate std::bitset::count for v > 32bit. Uses the generalized
+    // approach by Eric Cole.
+    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
+    v = v - ((v >> 1) & (T)~(T)0/3);
+    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
+    v = (v + (v >> 4)) & (T)~(T)0/255*15;
+    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
+  }
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return hamming_distance(x->data(), y->data(), f);
+  }
+  template<typename S, typename T>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T>* const* ys, size_t n, int f, T* out) {
+    const T* vs[batch_size];
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      hamming_distance_many(x->data(), vs, m, f, out + i);
+    }
+  }
+  template<typename S, typename T>
+  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
+    static const size_t n_bits = sizeof(T) * 8;
+    T chunk = n->v[0] / n_bits;
+    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    return margin(n, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, const SplitOptions&, Node<S, T>* n) {
+    // Instead of probing random coordinates until one splits the nodes, find the
+    // coordinates that do in one pass: those set in some but not all nodes. A
+    // coordinate that splits a subset also splits the whole set, so a random
+    // sample of the nodes is tried first and usually suffices. The sample has
+    // to be large enough to catch small groups of outliers, otherwise the
+    // split keeps peeling single items off the majority.
+    static const size_t n_bits = sizeof(T) * 8;
+    static const size_t n_sample_batches = 4;
+    vector<T> any(f, 0), all(f, ~(T)0);
+    const T* vs[batch_size];
+    size_t n_splitting = 0;
+    if (nodes.size() > n_sample_batches * batch_size) {
+      for (size_t j = 0; j < n_sample_batches; j++) {
+        for (size_t i = 0; i < batch_size; i++)
+          vs[i] = nodes[random.index(nodes.size())]->data();
+        bit_occupancy(vs, batch_size, f, &any[0], &all[0]);
+      }
+      for (int w = 0; w < f; w++)
+        n_splitting += popcount(any[w] & ~all[w]);
+    }
+    if (n_splitting == 0) {
+      for (size_t i = 0; i < nodes.size(); i += batch_size) {
+        size_t m = gather_vectors(&nodes[i], nodes.size() - i, vs);
+        bit_occupancy(vs, m, f, &any[0], &all[0]);
+      }
+      for (int w = 0; w < f; w++)
+        n_splitting += popcount(any[w] & ~all[w]);
+    }
+    n->v[0] = 0;
+    if (n_splitting == 0)
+      return; // All nodes are identical, _make_tree will randomize sides
+    // choose random position among those to split at
+    size_t k = random.index(n_splitting);
+    for (int w = 0; w < f; w++) {
+      T splitting = any[w] & ~all[w];
+      size_t c = popcount(splitting);
+      if (k >= c) {
+        k -= c;
+        continue;
+      }
+      for (size_t b = 0; b < n_bits; b++) {
+        // Same bit order as margin(): the most significant bit comes first
+        if ((splitting >> (n_bits - 1 - b)) & 1) {
+          if (k-- == 0) {
+            n->v[0] = w * n_bits + b;
+            return;
+          }
+        }
+      }
+    }
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return distance;
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  template<typename S, typename T, typename Random>
+  static inline void random_plane(Node<S, T>* n, int f, Random& random) {
+    // A random bit
+    n->v[0] = random.index((size_t)f * sizeof(T) * 8);
+  }
+  static const char* name() {
+    return "hamming";
+  }
+};
+
+
+struct Minkowski : Base {
+  template<typename S, typename T, typename V=T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    S n_descendants;
+    T a; // need an extra constant term to determine the offset of the plane
+    S children[2];
+    V v[1];
+    // Pointers to the packed fields, which GCC warns about taking directly
+    V* data() { return (V*)((char*)this + offsetof(Node, v)); }
+    const V* data() const { return (const V*)((const char*)this + offsetof(Node, v)); }
+    S* ids() { return (S*)((char*)this + offsetof(Node, children)); }
+    const S* ids() const { return (const S*)((const char*)this + offsetof(Node, children)); }
+  };
+  template<typename S, typename T, typename U, typename V>
+  static inline T margin(const Node<S, T, U>* n, const V* y, int f) {
+    return n->a + dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename U, typename V, typename Random>
+  static inline bool side(const Node<S, T, U>* n, const V* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return random.flip();
+  }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+  template<typename S, typename T, typename V>
+  static inline void balance_split(Node<S, T>* n, const Node<S, T, V>* const* nodes, size_t count, int f) {
+    // Offsets the plane to the median of the margins
+    vector<T> margins(count);
+    const V* vs[batch_size];
+    for (size_t i = 0; i < count; i += batch_size) {
+      size_t m = gather_vectors(nodes + i, count - i, vs);
+      dot_many(n->v, vs, m, f, &margins[i]);
+    }
+    std::nth_element(margins.begin(), margins.begin() + count / 2, margins.end());
+    n->a = -margins[count / 2];
+  }
+};
+
+
+struct Euclidean : Minkowski {
+  template<typename S, typename T, typename V>
+  static inline T distance(const Node<S, T>* x, const Node<S, T, V>* y, int f) {
+    return euclidean_distance(x->v, y->v, f);    
+  }
+  template<typename S, typename T, typename V>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T, V>* const* ys, size_t n, int f, T* out) {
+    const V* vs[batch_size];
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      euclidean_distance_many(x->data(), vs, m, f, out + i);
+    }
+  }
+  template<typename S, typename T, typename V, typename Random>
+  static inline void create_split(const vector<Node<S, T, V>*>& nodes, int f, size_t s, Random& random, const SplitOptions& options, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q, options);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "euclidean";
+  }
+
+};
+
+struct Manhattan : Minkowski {
+  template<typename S, typename T, typename V>
+  static inline T distance(const Node<S, T>* x, const Node<S, T, V>* y, int f) {
+    return manhattan_distance(x->v, y->v, f);
+  }
+  template<typename S, typename T, typename V>
+  static inline void distance_many(const Node<S, T>* x, const Node<S, T, V>* const* ys, size_t n, int f, T* out) {
+    const V* vs[batch_size];
+    for (size_t i = 0; i < n; i += batch_size) {
+      size_t m = gather_vectors(ys + i, n - i, vs);
+      manhattan_distance_many(x->data(), vs, m, f, out + i);
+    }
+  }
+  template<typename S, typename T, typename V, typename Random>
+  static inline void create_split(const vector<Node<S, T, V>*>& nodes, int f, size_t s, Random& random, const SplitOptions& options, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q, options);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return std::max(distance, T(0));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  template<typename T>
+  static inline T adc_term(const T* x, const T* c, int f) {
+    return manhattan_distance(x, c, f);
+  }
+  static const char* name() {
+    return "manhattan";
+  }
+};
+
+/*
+ * Split policies: how _make_tree chooses the plane that splits a set of
+ * nodes. They are the last template parameter of AnnoyIndex.
+ */
+struct TwoMeansSplit {
+  // The normal of the plane between two centroids found by two_means() (or,
+  // for Hamming, a bit that splits the nodes). See the metrics' create_split().
+  template<typename D, typename StoredNode, typename Node, typename Random>
+  static inline void create_split(const vector<StoredNode*>& nodes, int f, size_t s, Random& random,
+                                  const SplitOptions& options, Node* n) {
+    D::create_split(nodes, f, s, random, options, n);
+  }
+};
+
+struct RandomProjectionSplit {
+  // A random direction, moved to the median of a small sample of the nodes
+  // (see balance_split()). Much cheaper than two means, but the planes
+  // follow the data less closely, so queries need a higher search_k for the
+  // same recall.
+  enum { sample_size = 64 };
+
+  template<typename D, typename StoredNode, typename Node, typename Random>
+  static inline void create_split(const vector<StoredNode*>& nodes, int f, size_t, Random& random,
+                                  const SplitOptions&, Node* n) {
+    D::zero_value(n);
+    D::random_plane(n, f, random);
+    const StoredNode* sample[sample_size];
+    const size_t k = std::min(nodes.size(), (size_t)sample_size);
+    for (size_t i = 0; i < k; i++)
+      sample[i] = nodes[random.index(nodes.size())];
+    D::balance_split(n, sample, k, f);
+  }
+};
+
+template<typename Inner=TwoMeansSplit>
+struct BalancedSplit {
+  // The plane of Inner, moved so that it splits all nodes in half: the trees
+  // are as shallow as they get. Angular planes are tilted instead, which
+  // halves the nodes on the side of their mean; DotProduct and Hamming keep
+  // the planes of Inner.
+  template<typename D, typename StoredNode, typename Node, typename Random>
+  static inline void create_split(const vector<StoredNode*>& nodes, int f, size_t s, Random& random,
+                                  const SplitOptions& options, Node* n) {
+    Inner::template create_split<D>(nodes, f, s, random, options, n);
+    D::balance_split(n, &nodes[0], nodes.size(), f);
+  }
+};
+
+template<typename S, typename T>
+class ProductQuantizer {
+  /*
+   * Product quantization of the items (Jegou et al., 2011). The f dimensions
+   * are cut into m subspaces of f/m dimensions, and each sub-vector of an
+   * item is replaced by the index of the nearest of 2^nbits centroids trained
+   * for its subspace. Queries score the codes with per-query lookup tables
+   * of the distance to every centroid (asymmetric distance computation).
+   * 8-bit codes are stored one item after the other. 4-bit codes are stored
+   * in blocks of 32 items: for each subspace, 16 bytes holding items 0-15 in
+   * the low and items 16-31 in the high nibbles, so that a byte shuffle
+   * looks up a whole block at once ("fast scan", Andre et al., 2015).
+   */
+public:
+  struct Footer {
+    // Appended to quantized index files before they got a header (see
+    // IndexHeader); the tree nodes come first, without items
+    char magic[8];
+    uint32_t f, m, nbits, t_size;
+    uint64_t n_items, n_nodes, codes_offset, norms_offset, centroids_offset;
+  };
+
+  ProductQuantizer() : _f(0), _m(0), _nbits(0), _n_items(0), _codes(NULL), _norms(NULL), _centroids(NULL) {
+  }
+
+  void configure(int f, int m, int nbits) {
+    _f = f;
+    _m = m;
+    _nbits = nbits;
+    clear();
+  }
+
+  void clear() {
+    // Drops the codes and centroids, but keeps the configuration
+    _n_items = 0;
+    _codes = NULL;
+    _norms = NULL;
+    _centroids = NULL;
+    vector<uint8_t>().swap(_code_buf);
+    vector<T>().swap(_norm_buf);
+    vector<T>().swap(_centroid_buf);
+  }
+
+  bool enabled() const {
+    return _m > 0;
+  }
+
+  bool ready() const {
+    // True once there are codes to score
+    return _codes != NULL;
+  }
+
+  int m() const {
+    return _m;
+  }
+
+  int nbits() const {
+    return _nbits;
+  }
+
+  size_t codes_size() const {
+    if (_nbits == 4)
+      return ((size_t)_n_items + 31) / 32 * 16 * _m;
+    return (size_t)_n_items * _m;
+  }
+
+  size_t centroids_size() const {
+    return ((size_t)1 << _nbits) * _f * sizeof(T);
+  }
+
+  const uint8_t* codes() const {
+    return _codes;
+  }
+
+  const T* norms() const {
+    // Squared norms of the reconstructed items, one T per item
+    return _norms;
+  }
+
+  const T* centroids() const {
+    return _centroids;
+  }
+
+  template<typename Random>
+  void train(const T* sample, size_t n, Random& random, int iterations=15) {
+    // k-means in every subspace. sample holds n vectors of f elements.
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    _centroid_buf.resize(k * _f); // m x k x d
+    vector<T> sub(n * d), sums(k * d);
+    vector<size_t> counts(k);
+    vector<S> assignment(n);
+    for (int j = 0; j < _m; j++) {
+      for (size_t i = 0; i < n; i++)
+        memcpy(&sub[i * d], sample + i * _f + j * d, d * sizeof(T));
+      T* c = &_centroid_buf[j * k * d];
+      for (size_t l = 0; l < k; l++)
+        memcpy(c + l * d, &sub[random.index(n) * d], d * sizeof(T));
+      for (int it = 0; it < iterations; it++) {
+        _transpose(c);
+        for (size_t i = 0; i < n; i++)
+          assignment[i] = (S)_nearest(&sub[i * d]);
+        std::fill(sums.begin(), sums.end(), T(0));
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+          counts[assignment[i]]++;
+          for (int z = 0; z < d; z++)
+            sums[assignment[i] * d + z] += sub[i * d + z];
+        }
+        for (size_t l = 0; l < k; l++) {
+          if (counts[l] == 0) {
+            // Restart empty clusters from a random point
+            memcpy(c + l * d, &sub[random.index(n) * d], d * sizeof(T));
+          } else {
+            for (int z = 0; z < d; z++)
+              c[l * d + z] = sums[l * d + z] / counts[l];
+          }
+        }
+      }
+    }
+    _centroids = &_centroid_buf[0];
+  }
+
+  void allocate(S n_items) {
+    _n_items = n_items;
+    _code_buf.assign(codes_size(), 0);
+    _norm_buf.assign(n_items, 0);
+    _codes = &_code_buf[0];
+    _norms = &_norm_buf[0];
+  }
+
+  void encode(S item, const T* x) {
+    // allocate() first
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    for (int j = 0; j < _m; j++) {
+      _transpose(_centroids + j * k * d);
+      _set_code(item, j, _nearest(x + j * d));
+    }
+    _set_norm(item);
+  }
+
+  void encode_all(const T* vectors, S n) {
+    // Same as encode() for items 0 to n-1, vectors holds all of them
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    for (int j = 0; j < _m; j++) {
+      _transpose(_centroids + j * k * d);
+      for (S i = 0; i < n; i++)
+        _set_code(i, j, _nearest(vectors + (size_t)i * _f + j * d));
+    }
+    for (S i = 0; i < n; i++)
+      _set_norm(i);
+  }
+
+  void decode(S item, T* out) const {
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    for (int j = 0; j < _m; j++)
+      memcpy(out + j * d, _centroids + (j * k + _code(item, j)) * d, d * sizeof(T));
+  }
+
+  void attach(const void* codes, const void* norms, const void* centroids, S n_items) {
+    // Uses codes, norms and centroids that live elsewhere, e.g. in a mapped file
+    clear();
+    _n_items = n_items;
+    _codes = (const uint8_t*)codes;
+    _norms = (const T*)norms;
+    _centroids = (const T*)centroids;
+  }
+
+  template<typename D>
+  void distances(const T* x, const S* items, size_t n, T* out) const {
+    // Distances from x to the items, which should be sorted so that items
+    // sharing a block of 4-bit codes are scanned together
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    vector<T> lut(_m * k);
+    for (int j = 0; j < _m; j++)
+      for (size_t l = 0; l < k; l++)
+        lut[j * k + l] = D::adc_term(x + j * d, _centroids + (j * k + l) * d, d);
+    const T qq = dot(x, x, _f);
+
+    if (_nbits == 8) {
+      for (size_t i = 0; i < n; i++) {
+        const uint8_t* code = _codes + (size_t)items[i] * _m;
+        T sum = 0;
+        for (int j = 0; j < _m; j++)
+          sum += lut[j * k + code[j]];
+        out[i] = D::adc_distance(sum, qq, _norms[items[i]]);
+      }
+      return;
+    }
+
+    // Quantize the table to bytes: each subspace is shifted by its minimum
+    // and all are scaled alike, so that the sums of m entries fit 16 bits
+    vector<uint8_t> lut8(_m * k);
+    T bias = 0, range = 0;
+    for (int j = 0; j < _m; j++) {
+      T lo = *std::min_element(&lut[j * k], &lut[j * k] + k);
+      T hi = *std::max_element(&lut[j * k], &lut[j * k] + k);
+      bias += lo;
+      range = std::max(range, hi - lo);
+    }
+    const T scale = range > 0 ? 255 / range : 1;
+    for (int j = 0; j < _m; j++) {
+      T lo = *std::min_element(&lut[j * k], &lut[j * k] + k);
+      for (size_t l = 0; l < k; l++)
+        lut8[j * k + l] = (uint8_t)((lut[j * k + l] - lo) * scale + 0.5);
+    }
+
+    static const fast_scan_fn fast_scan = fast_scan_kernel();
+    uint16_t block_sums[32];
+    for (size_t i = 0; i < n; ) {
+      const S block = items[i] / 32;
+      size_t e = i + 1;
+      while (e < n && items[e] / 32 == block)
+        e++;
+      if (fast_scan && e - i > 1) {
+        fast_scan(_codes + (size_t)block * 16 * _m, &lut8[0], _m, block_sums);
+        for (; i < e; i++)
+          out[i] = D::adc_distance(bias + block_sums[items[i] % 32] / scale, qq, _norms[items[i]]);
+      } else {
+        for (; i < e; i++) {
+          uint16_t sum = 0;
+          for (int j = 0; j < _m; j++)
+            sum += lut8[j * k + _code(items[i], j)];
+          out[i] = D::adc_distance(bias + sum / scale, qq, _norms[items[i]]);
+        }
+      }
+    }
+  }
+
+protected:
+  int _f;
+  int _m;
+  int _nbits;
+  S _n_items;
+  const uint8_t* _codes;
+  const T* _norms;
+  const T* _centroids;
+  vector<uint8_t> _code_buf;
+  vector<T> _norm_buf;
+  vector<T> _centroid_buf;
+  vector<T> _transposed; // d x k centroids of the subspace being searched
+
+  void _transpose(const T* c) {
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    _transposed.resize(d * k);
+    for (size_t l = 0; l < k; l++)
+      for (int z = 0; z < d; z++)
+        _transposed[z * k + l] = c[l * d + z];
+  }
+
+  size_t _nearest(const T* x) const {
+    // Index of the centroid nearest to the sub-vector x, see _transpose()
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    T dist[256];
+    for (size_t l = 0; l < k; l++)
+      dist[l] = 0;
+    for (int z = 0; z < d; z++) {
+      // Runs across the centroids, so that it vectorizes
+      const T* c = &_transposed[z * k];
+      const T xz = x[z];
+      for (size_t l = 0; l < k; l++)
+        dist[l] += (xz - c[l]) * (xz - c[l]);
+    }
+    // Find the minimum first, which vectorizes, rather than its position
+    T best = dist[0];
+    for (size_t l = 1; l < k; l++)
+      best = std::min(best, dist[l]);
+    size_t l = 0;
+    while (dist[l] != best)
+      l++;
+    return l;
+  }
+
+  size_t _code(S item, int j) const {
+    if (_nbits == 8)
+      return _codes[(size_t)item * _m + j];
+    uint8_t c = _codes[((size_t)item / 32 * _m + j) * 16 + item % 16];
+    return (item % 32) < 16 ? c & 15 : c >> 4;
+  }
+
+  void _set_norm(S item) {
+    const size_t k = (size_t)1 << _nbits;
+    const int d = _f / _m;
+    T nn = 0;
+    for (int j = 0; j < _m; j++) {
+      const T* c = _centroids + (j * k + _code(item, j)) * d;
+      nn += dot(c, c, d);
+    }
+    _norm_buf[item] = nn;
+  }
+
+  void _set_code(S item, int j, size_t code) {
+    if (_nbits == 8) {
+      _code_buf[(size_t)item * _m + j] = (uint8_t)code;
+      return;
+    }
+    uint8_t& c = _code_buf[((size_t)item / 32 * _m + j) * 16 + item % 16];
+    if ((item % 32) < 16) c = (c & 0xf0) | (uint8_t)code;
+    else c = (c & 0x0f) | (uint8_t)(code << 4);
+  }
+};
+
+enum {
+  ANNOY_INDEX_VERSION = 4,
+  ANNOY_HEADER_SIZE = 4096 // The nodes start on the next page, or the next section
+};
+
+struct IndexHeader {
+  // At the start of index files from version 1 on, padded to
+  // ANNOY_HEADER_SIZE bytes. Offsets are in bytes from the start of the
+  // file. Older files have no header, see AnnoyIndex::load().
+  char magic[8]; // "ANNOYIDX"
+  uint32_t version;
+  uint32_t f;
+  char metric[32];
+  char storage[16]; // How the vectors are stored, see VectorStorage
+  uint32_t s_size, t_size, node_size, K;
+  uint64_t n_items, n_nodes, n_roots;
+  uint64_t node_offset; // Id of the first node in the file, n_items if the items are quantized
+  uint64_t nodes_offset;
+  uint64_t roots_offset; // n_roots ids
+  uint32_t pq_m, pq_nbits; // 0 without product quantization
+  uint64_t codes_offset, norms_offset, centroids_offset;
+  uint64_t file_size;
+  // Version 2. The nodes are in three runs: the items at nodes_offset,
+  // n_leaves leaves at leaves_offset and the splits at splits_offset. In a
+  // flat file they follow each other and n_leaves is 0; in a sectioned one
+  // every section starts at a multiple of section_size.
+  uint64_t n_leaves, leaves_offset, splits_offset;
+  uint64_t section_size;
+  // Version 3. If the items were reordered (see set_reorder_items), the
+  // external id of every item, then the item of every external id: 2 *
+  // n_items ids. 0 otherwise.
+  uint64_t ids_offset;
+  // Version 4. The number of items of a fat leaf (see set_leaf_size), 0
+  // if the leaves hold at most K ids.
+  uint64_t leaf_size;
+};
+
+enum {
+  // Where load() puts the index (see LoadOptions)
+  ANNOY_LOAD_MAPPED = 0,    // A shared mapping of the file, in the page cache
+  ANNOY_LOAD_ANONYMOUS = 1, // A copy in 2MB aligned anonymous memory, backed by transparent huge pages
+  ANNOY_LOAD_HUGETLB = 2    // A copy in huge pages reserved for hugetlbfs
+};
+
+struct LoadOptions {
+  // How load() brings an index into memory. The madvise hints only apply to
+  // mapped indexes; the copies are read in full when they are loaded.
+  int memory; // ANNOY_LOAD_*
+  bool hugepage; // MADV_HUGEPAGE, for file huge pages
+  bool random; // MADV_RANDOM, no readahead
+  bool willneed; // MADV_WILLNEED, read the file in the background
+  bool populate; // MAP_POPULATE, read the file before load() returns
+  bool prefault; // Touch every page before load() returns
+  bool lock; // mlock the index, so that it's never paged out
+  LoadOptions() : memory(ANNOY_LOAD_MAPPED), hugepage(false), random(false), willneed(false),
+                  populate(false), prefault(false), lock(false) {}
+};
+
+enum {
+  // What save() does with the index once it has written it (see SaveOptions)
+  ANNOY_SAVE_RELOAD = 0, // Frees the nodes and loads the file instead
+  ANNOY_SAVE_KEEP = 1    // Keeps the nodes in memory as they are
+};
+
+enum {
+  // When save() flushes the file to the disk
+  ANNOY_SYNC_NONE = 0, // Whenever the kernel likes
+  ANNOY_SYNC_END = 1,  // Before returning
+  ANNOY_SYNC_CHUNK = 2 // Also every chunk as it is written, so that dirty pages don't pile up
+};
+
+struct SaveOptions {
+  // How save() writes an index: n_threads writers take turns at the chunks of
+  // the file and write each with one pwrite, straight from the nodes where
+  // they are in one piece
+  int after; // ANNOY_SAVE_*
+  int n_threads; // -1 for one per core
+  size_t chunk_size; // A multiple of 4096 bytes
+  bool direct; // O_DIRECT, past the page cache, where the file system has it
+  int sync; // ANNOY_SYNC_*
+  LoadOptions load; // Of the file, with ANNOY_SAVE_RELOAD
+  SaveOptions() : after(ANNOY_SAVE_RELOAD), n_threads(-1), chunk_size((size_t)8 << 20), direct(false),
+                  sync(ANNOY_SYNC_NONE) {}
+};
+
+enum {
+  // How warmup() brings a loaded index into memory (see WarmupOptions)
+  ANNOY_WARM_TOUCH = 0,     // Touch every page, the threads taking chunks from the front of the file
+  ANNOY_WARM_READAHEAD = 1, // The same, with a readahead (or MADV_WILLNEED) of each chunk first
+  ANNOY_WARM_TOP_DOWN = 2   // The trees a level at a time from the roots, then the rest as ANNOY_WARM_TOUCH
+};
+
+struct WarmupOptions {
+  int strategy; // ANNOY_WARM_*
+  int n_threads; // -1 for one per core
+  size_t chunk_size; // What a thread touches, or reads ahead, at a time
+  WarmupOptions() : strategy(ANNOY_WARM_TOUCH), n_threads(-1), chunk_size((size_t)64 << 20) {}
+};
+
+struct WarmupStats {
+  size_t bytes; // Of the index that were warmed
+  double seconds; // Until all of them were
+  double tree_seconds; // Until the trees were, which is sooner with ANNOY_WARM_TOP_DOWN
+  WarmupStats() : bytes(0), seconds(0), tree_seconds(0) {}
+  double bytes_per_second() const {
+    return seconds > 0 ? bytes / seconds : 0;
+  }
+};
+
+template<typename S, typename T>
+class AnnoyIndexInterface {
+ public:
+  virtual ~AnnoyIndexInterface() {};
+  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool unbuild(char** error=NULL) = 0;
+  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual void unload() = 0;
+  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual T get_distance(S i, S j) const = 0;
+  virtual void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual S get_n_items() const = 0;
+  virtual S get_n_trees() const = 0;
+  virtual void verbose(bool v) = 0;
+  virtual void get_item(S item, T* v) const = 0;
+  virtual void set_seed(int q) = 0;
+  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
+};
+
+template<typename I, I N>
+struct FixedField {
+  // A field of an index that is a compile-time constant, see IndexShape.
+  // Reads as N, whatever it is set to.
+  FixedField() {}
+  explicit FixedField(I) {}
+  FixedField& operator=(I) { return *this; }
+  inline operator I() const { return N; }
+};
+
+template<typename I>
+struct RuntimeField {
+  I value;
+  RuntimeField() {}
+  explicit RuntimeField(I value) : value(value) {}
+  RuntimeField& operator=(I v) { value = v; return *this; }
+  inline operator I() const { return value; }
+};
+
+template<typename S, typename V, typename Node, int F>
+struct IndexShape {
+  // The dimension, node size and _K of an index whose dimension F is fixed
+  // at compile time: the distance kernels, node addressing and leaf scans
+  // of the index get them as constants.
+  static const size_t node_size = offsetof(Node, v) + F * sizeof(V) + VectorStorage<V>::scale_size;
+  typedef FixedField<int, F> Dimension;
+  typedef FixedField<size_t, node_size> NodeSize;
+  typedef FixedField<S, (S)((node_size - offsetof(Node, children)) / sizeof(S))> LeafSize;
+};
+
+template<typename S, typename V, typename Node>
+struct IndexShape<S, V, Node, 0> {
+  // All set from the f given to the constructor
+  typedef RuntimeField<int> Dimension;
+  typedef RuntimeField<size_t> NodeSize;
+  typedef RuntimeField<S> LeafSize;
+};
+
+template<typename S, typename T, typename Distance, typename Random, typename V=T, typename Split=TwoMeansSplit, int F=0>
+  class AnnoyIndex : public AnnoyIndexInterface<S, T> {
+  /*
+   * We use random projection to build a forest of binary trees of all items.
+   * Basically just split the hyperspace into two sides by a hyperplane,
+   * then recursively split each of those subtrees etc.
+   * We create a tree like this q times. The default q is determined automatically
+   * in such a way that we at most use 2x as much memory as the vectors take.
+   * V is the element type the node vectors are stored as. With one of the
+   * reduced precision types (Float16, BFloat16, ScaledInt8, which need
+   * T = float) the index shrinks 2-4x; queries and split planes are still
+   * computed in T, and the best candidates can be rescored against full
+   * precision copies of the items (see set_keep_exact, save_exact and
+   * load_exact).
+   * Going further, set_product_quantization replaces the items by product
+   * quantization codes of a few bytes each; only the split nodes are kept.
+   * Split chooses the planes: TwoMeansSplit, RandomProjectionSplit or
+   * BalancedSplit<...>.
+   * F > 0 fixes the dimension at compile time (the constructor must then be
+   * given f = F, or it aborts), which makes the node size and _K constants
+   * too. Files are the same as those of an index with a runtime dimension.
+   */
+public:
+  typedef Distance D;
+  typedef typename D::template Node<S, T, V> Node;
+  typedef typename D::template Node<S, T> FullNode; // Queries and split planes under construction
+  typedef IndexShape<S, V, Node, F> Shape;
+
+protected:
+  const typename Shape::Dimension _f;
+  typename Shape::NodeSize _s;
+  size_t _fs; // Size of a FullNode
+  S _n_items;
+  Random _random;
+  uint32_t _seed; // The trees draw from generators seeded from this, see _tree_random()
+  void* _nodes; // Could either be mmapped, or point into _arena
+  NodeArena _arena; // Also maps the file of on_disk_build
+  int _writeback; // See set_on_disk_writeback()
+  size_t _writeback_interval;
+  size_t _written_back; // Bytes of the file
+  size_t _build_budget; // See set_build_memory_budget()
+  std::string _spill_prefix; // Temporary files of out-of-core builds go there
+
+  S _n_nodes;
+  S _nodes_size;
+  vector<S> _roots;
+  typename Shape::LeafSize _K;
+  bool _loaded;
+  bool _verbose;
+  int _fd;
+  bool _on_disk;
+  bool _built;
+  vector<T> _exact_items; // Full precision copies of the items, if V is reduced precision
+  bool _keep_exact; // See set_keep_exact()
+  void* _exact_map; // Or a mapped side file of them
+  size_t _exact_map_size;
+  size_t _rescore_factor;
+  SplitOptions _split_options;
+  ProductQuantizer<S, T> _pq;
+  S _node_offset; // Index of the first node in _nodes, n_items when the items are quantized
+  S _leaf_first; // Nodes from _leaf_first on are in _leaves, see ANNOY_LAYOUT_SECTIONED
+  S _split_first; // and from _split_first on in _splits
+  const void* _leaves;
+  const void* _splits;
+  int _layout;
+  size_t _header_bytes; // Room for the header before the nodes of an on-disk build
+  void* _file_map; // The file of a loaded index
+  size_t _mapped_size;
+  int _load_memory; // LoadOptions::memory of a loaded index
+  bool _reorder; // See set_reorder_items()
+  S _leaf_size; // See set_leaf_size(), 0 for leaves of at most _K ids
+  vector<S> _ids; // The two tables below of an index reordered in memory
+  const S* _external_ids; // Of the items, if they were reordered
+  const S* _internal_ids; // The items of the external ids
+#ifdef ANNOY_MULTITHREADED_BUILD
+  struct WarmupState {
+    std::thread thread;
+    std::atomic<size_t> next; // Offset of the next chunk to warm
+    std::atomic<size_t> warmed;
+    WarmupStats stats;
+    WarmupState() : next(0), warmed(0) {}
+  };
+  WarmupState* _warmup; // Of warmup_in_background()
+#endif
+public:
+
+   AnnoyIndex(int f) : _f(f), _random(), _seed(0) {
+    if (F > 0 && f != F) {
+      // _f reads as F whatever it is given, so every vector would be read
+      // with the wrong length
+      showUpdate("Error: an index of dimension %d can't be constructed with f = %d\n", F, f);
+      abort();
+    }
+    _s = offsetof(Node, v) + VectorStorage<V>::size(_f); // Size of each node
+    _fs = offsetof(FullNode, v) + _f * sizeof(T);
+    _verbose = false;
+    _built = false;
+    _rescore_factor = 4;
+    _keep_exact = false;
+    _writeback = ANNOY_WRITEBACK_NONE;
+    _writeback_interval = (size_t)64 << 20;
+    _written_back = 0;
+    _build_budget = 0;
+    _layout = ANNOY_LAYOUT_FLAT;
+    _reorder = false;
+    _leaf_size = 0;
+#ifdef ANNOY_MULTITHREADED_BUILD
+    _warmup = NULL;
+#endif
+    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
+    reinitialize(); // Reset everything
+  }
+  ~AnnoyIndex() {
+    unload();
+  }
+
+  int get_f() const {
+    return _f;
+  }
+
+  const char* get_kernel_name() const {
+    // Name of the distance kernels selected for this host, e.g. "avx512", or
+    // "avx512/128" when they are specialized for the dimension
+    return Kernels<T>::get(_f)->name;
+  }
+
+  size_t get_hugepage_bytes() const {
+    // How much of the memory of an index built in memory the kernel backs
+    // with transparent huge pages (always 0 outside Linux)
+    return _arena.hugepage_bytes();
+  }
+
+  bool add_item(S item, const T* w, char** error=NULL) {
+    return add_item_impl(item, w, error);
+  }
+
+  template<typename W>
+  bool add_item_impl(S item, const W& w, char** error=NULL) {
+    if (_loaded) {
+      showUpdate("You can't add an item to a loaded index\n");
+      if (error) *error = (char *)"You can't add an item to a loaded index";
+      return false;
+    }
+    if (_external_ids) {
+      showUpdate("You can't add an item to a reordered index, unbuild it first\n");
+      if (error) *error = (char *)"You can't add an item to a reordered index, unbuild it first";
+      return false;
+    }
+    if (!_allocate_size(item + 1)) {
+      if (error) *error = (char *)"Unable to allocate memory for the nodes";
+      return false;
+    }
+    if (!VectorStorage<V>::exact && _keep_exact && _exact_items.size() < ((size_t)item + 1) * _f)
+      _exact_items.resize(((size_t)item + 1) * _f);
+    _add(item, w);
+
+    if (item >= _n_items)
+      _n_items = item + 1;
+    _write_back(_n_items, false, false);
+
+    return true;
+  }
+
+  bool add_items(const T* base, S first_id, S count, size_t stride=0, int n_threads=-1, char** error=NULL) {
+    // Adds count items at once, as first_id, first_id + 1, ... Row i starts
+    // i * stride bytes after base, stride 0 meaning that the rows are packed.
+    // The rows are copied by n_threads threads (all cores if -1).
+    return add_items_impl(base, first_id, count, stride ? stride : _f * sizeof(T), n_threads, error);
+  }
+
+  bool add_items_from_file(const char* filename, S first_id=0, int n_threads=-1, char** error=NULL) {
+    // Adds all the vectors of a .fvecs or .bvecs file, or else of a raw file
+    // of rows of f T's, as first_id, first_id + 1, ... The file is mapped and
+    // copied from in parallel, there's no way to adopt the mapping as it is
+    // since the nodes keep their headers inline with the vectors.
+    const char* msg = NULL;
+    const bool fvecs = _has_suffix(filename, ".fvecs"), bvecs = _has_suffix(filename, ".bvecs");
+    const size_t header = (fvecs || bvecs) ? sizeof(int32_t) : 0; // The dimension of each row
+    const size_t row = header + _f * (fvecs ? sizeof(float) : bvecs ? sizeof(uint8_t) : sizeof(T));
+
+    int fd = open(filename, O_RDONLY, (int)0400);
+    if (fd == -1) {
+      showUpdate("Error: file descriptor is -1\n");
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0)
+      msg = "Size of file is zero";
+    else if (size % row)
+      msg = "File size is not a multiple of the row size";
+    else if ((size_t)size / row > (size_t)numeric_limits<S>::max())
+      msg = "Too many vectors in file";
+    if (msg) {
+      showUpdate("Error: %s\n", msg);
+      if (error) *error = (char *)msg;
+      close(fd);
+      return false;
+    }
+    char* data = (char*)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == (char*)MAP_FAILED) {
+      showUpdate("Error: unable to map %s: %s\n", filename, strerror(errno));
+      if (error) *error = strerror(errno);
+      return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+    const S count = (S)((size_t)size / row);
+    bool res;
+    if (header && (*(int32_t*)data != _f || *(int32_t*)(data + (size_t)(count - 1) * row) != _f)) {
+      showUpdate("Error: vectors in %s don't have %d dimensions\n", filename, (int)_f);
+      if (error) *error = (char *)"Dimension in file does not match f";
+      res = false;
+    } else if (fvecs) {
+      res = add_items_impl((const float*)(data + header), first_id, count, row, n_threads, error);
+    } else if (bvecs) {
+      res = add_items_impl((const uint8_t*)(data + header), first_id, count, row, n_threads, error);
+    } else {
+      res = add_items_impl((const T*)data, first_id, count, row, n_threads, error);
+    }
+    munmap(data, size);
+    return res;
+  }
+
+  template<typename W>
+  bool add_items_impl(const W* base, S first_id, S count, size_t stride, int n_threads=-1, char** error=NULL) {
+    if (_loaded) {
+      showUpdate("You can't add an item to a loaded index\n");
+      if (error) *error = (char *)"You can't add an item to a loaded index";
+      return false;
+    }
+    if (_external_ids) {
+      showUpdate("You can't add an item to a reordered index, unbuild it first\n");
+      if (error) *error = (char *)"You can't add an item to a reordered index, unbuild it first";
+      return false;
+    }
+    const bool negative = numeric_limits<S>::is_signed && (first_id < (S)0 || count < (S)0); // Never for unsigned S
+    if (negative || (size_t)first_id + count > (size_t)numeric_limits<S>::max()) {
+      showUpdate("Error: item ids out of range\n");
+      if (error) *error = (char *)"Item ids out of range";
+      return false;
+    }
+    if (count == 0)
+      return true;
+    const S end = first_id + count;
+    if (!_allocate_size(end)) {
+      if (error) *error = (char *)"Unable to allocate memory for the nodes";
+      return false;
+    }
+    if (!VectorStorage<V>::exact && _keep_exact && _exact_items.size() < (size_t)end * _f)
+      _exact_items.resize((size_t)end * _f);
+
+#ifdef ANNOY_MULTITHREADED_BUILD
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+#else
+    n_threads = 1;
+#endif
+    // Written back between batches when building on disk, so that the
+    // dirty pages stay bounded by the interval
+    S batch = count;
+    if (_on_disk && _writeback != ANNOY_WRITEBACK_NONE)
+      batch = (S)std::max((size_t)1, std::min((size_t)count, _writeback_interval / _s));
+    for (S done = 0; done < count; done += std::min(batch, count - done)) {
+      const S n = std::min(batch, count - done);
+      const char* rows = (const char*)base + (size_t)done * stride;
+      const int threads = (int)std::max((S)1, std::min((S)n_threads, n / 1024)); // Not worth a thread otherwise
+#ifdef ANNOY_MULTITHREADED_BUILD
+      vector<std::thread> pool;
+      for (int i = 1; i < threads; i++)
+        pool.push_back(std::thread(&AnnoyIndex::template _add_rows<W>, this, rows, stride,
+                                   first_id + done, (S)((size_t)n * i / threads), (S)((size_t)n * (i + 1) / threads)));
+#endif
+      _add_rows<W>(rows, stride, first_id + done, 0, (S)((size_t)n / threads));
+#ifdef ANNOY_MULTITHREADED_BUILD
+      for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+#endif
+      if (first_id + done + n > _n_items)
+        _n_items = first_id + done + n;
+      _write_back(_n_items, false, false);
+    }
+    return true;
+  }
+    
+  bool set_product_quantization(int m, int nbits=8, char** error=NULL) {
+    // Quantizes the items into m codes of nbits (4 or 8) bits each when the
+    // index is built; f must be a multiple of m. Queries then score the
+    // candidates from the codes, and saved indexes hold the codes instead of
+    // the items. 0 turns quantization off. Call before building.
+    const char* msg = NULL;
+    if (_loaded || _built || _on_disk)
+      msg = "Product quantization has to be set before building";
+    else if (std::numeric_limits<T>::is_integer)
+      msg = "Product quantization needs floating point vectors";
+    else if (m < 0 || m > 256 || (m > 0 && _f % m))
+      msg = "The number of subspaces has to divide f";
+    else if (nbits != 4 && nbits != 8)
+      msg = "Codes have to be 4 or 8 bits";
+    else if (nbits == 4 && m % 2)
+      msg = "4 bit codes need an even number of subspaces";
+    else if (m > 0 && _leaf_size)
+      msg = "Product quantization does not support fat leaves";
+    if (msg) {
+      showUpdate("%s\n", msg);
+      if (error) *error = (char *)msg;
+      return false;
+    }
+    _pq.configure(_f, m, nbits);
+    return true;
+  }
+
+  bool on_disk_build(const char* file, char** error=NULL) {
+    if (_pq.enabled()) {
+      showUpdate("Product quantization does not support building on disk\n");
+      if (error) *error = (char *)"Product quantization does not support building on disk";
+      return false;
+    }
+    if (_loaded || _arena.data()) {
+      showUpdate("You have to build on disk before adding items\n");
+      if (error) *error = (char *)"You have to build on disk before adding items";
+      return false;
+    }
+    _on_disk = true;
+    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+    if (_fd == -1) {
+      showUpdate("Error: file descriptor is -1\n");
+      if (error) *error = strerror(errno);
+      _fd = 0;
+      return false;
+    }
+    _arena.map_file(_fd);
+    _header_bytes = ANNOY_HEADER_SIZE;
+    _written_back = 0;
+    _spill_prefix = std::string(file) + ".spill.";
+    if (!_allocate_size(1)) {
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  void set_on_disk_writeback(int mode, size_t interval=(size_t)64 << 20) {
+    // How on_disk_build writes the file back. ANNOY_WRITEBACK_NONE leaves
+    // it to the kernel, which may let gigabytes of dirty pages pile up and
+    // then stall the build flushing them. ANNOY_WRITEBACK_MSYNC writes back
+    // every interval bytes of new nodes, and all of them at the end of the
+    // build. ANNOY_WRITEBACK_DONTNEED does the same and then drops the trees
+    // it wrote from memory; the items stay, the build reads them again.
+    _writeback = mode;
+    _writeback_interval = interval;
+  }
+
+  void set_layout(int layout) {
+    // How save() writes the nodes. ANNOY_LAYOUT_FLAT writes them in the
+    // order of their ids. ANNOY_LAYOUT_SECTIONED renumbers the tree nodes
+    // to put the items, the leaves and the splits into separate sections,
+    // each starting at a multiple of 2MB and padded to one, so that load()
+    // can have each of them backed by file huge pages on its own.
+    // ANNOY_LAYOUT_BLOCKED also orders the tree nodes along the trees: the
+    // leaves from left to right, and the splits in nested blocks, the
+    // levels of a subtree that fit into 2MB, within those into 4KB, and
+    // within those into a cache line, so that a descent touches few pages
+    // of either size. Indexes built on disk are always flat.
+    _layout = layout;
+  }
+
+  void set_reorder_items(bool reorder) {
+    // Moves the items into the order of the leaves of the first tree once
+    // the trees are built, so that the candidates of a leaf are next to
+    // each other and scoring them reads adjacent vectors. The index keeps
+    // the ids the items were added with and takes and returns only those.
+    // Call before building.
+    _reorder = reorder;
+  }
+
+  bool set_leaf_size(int n, char** error=NULL) {
+    // Makes the leaves fat: they take up to n items (32 to 256 work well)
+    // instead of the K ids that fit into a node, and keep copies of the
+    // item vectors right behind them, so that a query scores a leaf from
+    // one run of memory instead of reading each item where it is. Every
+    // tree then holds all items once more, so build(-1) makes one tree.
+    // 0 goes back to leaves of ids. Call before building.
+    const char* msg = NULL;
+    if (_loaded || _built)
+      msg = "The leaf size has to be set before building";
+    else if (n != 0 && (n < 2 || n > 4096))
+      msg = "Fat leaves have to hold 2 to 4096 items";
+    else if (n != 0 && _pq.enabled())
+      msg = "Product quantization does not support fat leaves";
+    if (msg) {
+      showUpdate("%s\n", msg);
+      if (error) *error = (char *)msg;
+      return false;
+    }
+    _leaf_size = (S)n;
+    return true;
+  }
+
+  bool set_build_memory_budget(size_t bytes, char** error=NULL) {
+    // Builds on disk whose items take more than bytes go out of core. Each
+    // tree then splits the items top-down into temporary files next to the
+    // index, reading and writing them sequentially, until a part fits in
+    // bytes; the subtree of that part is built in memory and written to the
+    // index right away. The splits on the way down are computed from a
+    // sample. Trees are built one after another, and the temporary files
+    // take up to about twice the size of the items. 0, the default, builds
+    // everything in memory.
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    if (bytes) {
+      showUpdate("Out-of-core builds are not supported on Windows\n");
+      if (error) *error = (char *)"Out-of-core builds are not supported on Windows";
+      return false;
+    }
+#else
+    (void)error; // Nothing else can fail
+#endif
+    _build_budget = bytes;
+    return true;
+  }
+    
+  bool build(int q, int n_threads=-1, char** error=NULL) {
+    // Builds q trees (or as many as fit in 2x the memory of the items if q
+    // is -1) on n_threads threads, all cores if -1. Every tree draws from its
+    // own generator, so the index is the same for any number of threads.
+    if (_loaded) {
+      showUpdate("You can't build a loaded index\n");
+      if (error) *error = (char *)"You can't build a loaded index";
+      return false;
+    }
+
+    if (_built) {
+      showUpdate("You can't build a built index\n");
+      if (error) *error = (char *)"You can't build a built index";
+      return false;
+    }
+
+    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+
+    if (_on_disk && _build_budget && (size_t)_n_items * _s > _build_budget && _n_items > _max_leaf()) {
+      if (!_build_external(q, error))
+        return false;
+    } else if (!_build_in_memory(q, n_threads, error)) {
+      return false;
+    }
+
+    // Also, copy the roots into the last segment of the array
+    // This way we can load them faster without reading the whole file
+    // (Fat leaves only go into files with a header, which has the roots)
+    if (!_leaf_size) {
+      for (size_t i = 0; i < _roots.size(); i++)
+        memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
+      _n_nodes += _roots.size();
+    }
+
+    if (_verbose) showUpdate("has %zu nodes\n", (size_t)_n_nodes);
+    if (_verbose && !_on_disk)
+      showUpdate("%zu MB of nodes, %zu MB in huge pages\n", _arena.committed() >> 20, _arena.hugepage_bytes() >> 20);
+
+    if (_reorder)
+      _reorder_by_leaves();
+
+    if (_pq.enabled())
+      _quantize();
+    
+    if (_on_disk) {
+      // Add the roots and the header around the nodes
+      IndexHeader header;
+      _fill_header(&header, 0, 0);
+      char* data = (char*)_arena.grow(header.file_size);
+      if (!data) {
+        showUpdate("Unable to allocate %zu bytes for the index: %s\n", (size_t)header.file_size, strerror(errno));
+        if (error) *error = strerror(errno);
+        return false;
+      }
+      _nodes = data + _header_bytes;
+      if (!_roots.empty())
+        memcpy(data + header.roots_offset, &_roots[0], _roots.size() * sizeof(S));
+      if (_external_ids)
+        memcpy(data + header.ids_offset, &_ids[0], _ids.size() * sizeof(S));
+      memcpy(data, &header, sizeof(header));
+      if (!_arena.truncate(header.file_size)) {
+	// TODO: this probably creates an index in a corrupt state... not sure what to do
+	showUpdate("Error truncating file: %s\n", strerror(errno));
+	if (error) *error = strerror(errno);
+	return false;
+      }
+      _nodes_size = _n_nodes;
+      _write_back(_n_nodes, true, true);
+      if (_writeback != ANNOY_WRITEBACK_NONE)
+        msync(data, header.file_size, MS_SYNC); // Only the header and the roots are still dirty
+    }
+    _built = true;
+    return true;
+  }
+
+protected:
+  bool _build_in_memory(int q, int n_threads, char** error) {
+    // All trees at once on n_threads threads. Each tree is in memory until it
+    // is done and all trees before it are, then it goes after them in _nodes.
+    BuildState state;
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants >= 1) { // Issue #223
+        state.indices.push_back(i);
+        state.items.push_back(_get(i));
+      }
+    }
+    state.q = q;
+    state.next = 0;
+    state.n_counted = 0;
+    state.n_counted_nodes = 0;
+    state.n_flushed = 0;
+    state.n_trees = (q == -1) ? (_n_items > 0 ? (size_t)-1 : 0) : (size_t)q;
+    _n_nodes = _n_items;
+    _write_back(_n_items, false, true); // So that only trees get dropped
+
+#ifdef ANNOY_MULTITHREADED_BUILD
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    vector<std::thread> threads;
+    for (int i = 1; i < n_threads; i++)
+      threads.push_back(std::thread(&AnnoyIndex::_build_trees, this, &state));
+    _build_trees(&state);
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+#else
+    _build_trees(&state);
+#endif
+
+    // Append the trees that are left, now that no thread reads the items
+    // anymore and the nodes may move
+    state.trees.resize(state.n_trees);
+    size_t n_tree_nodes = 0;
+    for (size_t t = state.n_flushed; t < state.trees.size(); t++)
+      n_tree_nodes += state.trees[t].n;
+    // Plus the copies of the roots
+    if (!_check_node_ids((size_t)_n_nodes + n_tree_nodes + state.trees.size(), error))
+      return false;
+    if (!_allocate_size(_n_nodes + (S)n_tree_nodes + (S)state.trees.size())) {
+      if (error) *error = (char *)"Unable to allocate memory for the nodes";
+      return false;
+    }
+    for (size_t t = state.n_flushed; t < state.trees.size(); t++)
+      _flush_built_tree(state.trees[t]);
+    return true;
+  }
+
+  bool _check_node_ids(size_t n_nodes, char** error) const {
+    // The ids of all nodes, the items first, have to fit into S
+    if (n_nodes <= (size_t)numeric_limits<S>::max())
+      return true;
+    showUpdate("Error: %zu nodes are more than the node ids can number\n", n_nodes);
+    if (error) *error = (char *)"More nodes than the node ids can number, use a wider id type";
+    return false;
+  }
+
+  bool _build_external(int q, char** error) {
+    // See set_build_memory_budget(). Every tree goes to the file as soon as
+    // parts of it are done, so only the subtree being built is in memory.
+    size_t count = 0;
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants >= 1) // Issue #223
+        count++;
+    }
+    _n_nodes = _n_items;
+    _write_back(_n_items, false, true); // So that only trees get dropped
+    TreeScratch scratch;
+    size_t n_tree_nodes = 0;
+    for (size_t t = 0; q == -1 ? n_tree_nodes < (size_t)_n_items : t < (size_t)q; t++) {
+      if (_verbose) showUpdate("pass %zd...\n", t);
+      TreeNodes tree;
+      Random random = _tree_random(t);
+      Spill items = {(const char*)_nodes, (size_t)_n_items, _s, false, 0};
+      const char* msg = NULL;
+      tree.root = _make_tree_external(items, count, true, random, tree, scratch, _n_nodes, &msg);
+      if (!msg && !_flush_tree(tree, _n_nodes))
+        msg = "Unable to allocate memory for the nodes";
+      if (msg) {
+        showUpdate("Error building tree %zd out of core: %s\n", t, msg);
+        if (error) *error = (char *)msg;
+        return false;
+      }
+      _roots.push_back(tree.root + (_n_nodes - _n_items));
+      _n_nodes += tree.n;
+      n_tree_nodes += tree.n;
+      _write_back(_n_nodes, true, false);
+    }
+    if (!_check_node_ids((size_t)_n_nodes + _roots.size(), error))
+      return false;
+    if (!_allocate_size(_n_nodes + (S)_roots.size())) {
+      if (error) *error = (char *)"Unable to allocate memory for the nodes";
+      return false;
+    }
+    return true;
+  }
+
+public:  
+  bool unbuild(char** error=NULL) {
+    if (_loaded) {
+      showUpdate("You can't unbuild a loaded index\n");
+      if (error) *error = (char *)"You can't unbuild a loaded index";
+      return false;
+    }
+
+    _roots.clear();
+    _n_nodes = _n_items;
+    _built = false;
+    if (_external_ids) {
+      // Back to the ids they were added with
+      vector<S> order(_internal_ids, _internal_ids + _n_items);
+      _permute_items(order);
+      _ids.clear();
+      _external_ids = NULL;
+      _internal_ids = NULL;
+    }
+
+    return true;
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    SaveOptions options;
+    options.load.prefault = prefault;
+    return save(filename, options, error);
+  }
+
+  bool save(const char* filename, const SaveOptions& options, char** error=NULL) {
+    if (!_built) {
+      showUpdate("You can't save an index that hasn't been built\n");
+      if (error) *error = (char *)"You can't save an index that hasn't been built";
+      return false;
+    }
+    if (_on_disk) {
+      return true;
+    } else {
+      // Delete file if it already exists (See issue #335)
+      unlink(filename);
+
+      if (_verbose) showUpdate("saving to %s\n", filename);
+
+      int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+      if (options.direct)
+        flags |= O_DIRECT;
+#endif
+      int fd = open(filename, flags, (int)0644);
+#ifdef O_DIRECT
+      if (fd == -1 && errno == EINVAL && options.direct)
+        fd = open(filename, flags & ~O_DIRECT, (int)0644); // Not on this file system (tmpfs)
+#elif defined(F_NOCACHE)
+      if (fd != -1 && options.direct)
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+      if (fd == -1) {
+        showUpdate("Unable to open: %s\n", strerror(errno));
+        if (error) *error = strerror(errno);
+        return false;
+      }
+
+      IndexHeader header;
+      vector<S> renumbered, roots;
+      vector<Segment> segments;
+      _plan_index(&header, &renumbered, &roots, &segments);
+      bool ok = _write_index(fd, segments, renumbered, header.file_size, options)
+        && ftruncate(fd, header.file_size) == 0; // Sets the size, after O_DIRECT wrote whole blocks
+      if (ok && options.sync != ANNOY_SYNC_NONE) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        ok = _commit(fd) == 0;
+#elif defined(__linux__)
+        ok = fdatasync(fd) == 0;
+#else
+        ok = fsync(fd) == 0;
+#endif
+      }
+      if (!ok) {
+        showUpdate("Unable to write: %s\n", strerror(errno));
+        if (error) *error = strerror(errno);
+        close(fd);
+        return false;
+      }
+      if (close(fd) == -1) {
+        showUpdate("Unable to close: %s\n", strerror(errno));
+        if (error) *error = strerror(errno);
+        return false;
+      }
+      if (options.after == ANNOY_SAVE_KEEP)
+        return true;
+
+      // Reloading from the file drops the full precision vectors, unless
+      // they are to be kept
+      vector<T> exact_items;
+      if (_keep_exact)
+        exact_items.swap(_exact_items);
+      unload();
+      bool loaded = load(filename, options.load, error);
+      _exact_items.swap(exact_items);
+      return loaded;
+    }
+  }
+
+  bool save_exact(const char* filename, char** error=NULL) {
+    // Writes the full precision vectors as a flat array of n_items * f T's,
+    // the side file for load_exact. Only available if V is reduced precision
+    // and the vectors were kept, see set_keep_exact.
+    if (!_has_exact()) {
+      showUpdate("There are no full precision vectors to save, see set_keep_exact\n");
+      if (error) *error = (char *)"There are no full precision vectors to save, see set_keep_exact";
+      return false;
+    }
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+      showUpdate("Unable to open: %s\n", strerror(errno));
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    if (fwrite(_get_exact(0), _f * sizeof(T), _n_items, f) != (size_t) _n_items) {
+      showUpdate("Unable to write: %s\n", strerror(errno));
+      if (error) *error = strerror(errno);
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      showUpdate("Unable to close: %s\n", strerror(errno));
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool load_exact(const char* filename, char** error=NULL) {
+    // Maps a side file written by save_exact (or any flat array of the items
+    // in T). The best candidates of each query are then rescored against it.
+    int fd = open(filename, O_RDONLY, (int)0400);
+    if (fd == -1) {
+      showUpdate("Error: file descriptor is -1\n");
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size != (off_t)((size_t)_n_items * _f * sizeof(T))) {
+      showUpdate("Error: side file size %zu does not match %zu items\n", (size_t)size, (size_t)_n_items);
+      if (error) *error = (char *)"Side file size does not match the index";
+      close(fd);
+      return false;
+    }
+    void* exact_map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (exact_map == MAP_FAILED) {
+      showUpdate("Error: unable to map side file: %s\n", strerror(errno));
+      if (error) *error = strerror(errno);
+      return false;
+    }
+    if (_exact_map)
+      munmap(_exact_map, _exact_map_size);
+    _exact_map = exact_map;
+    _exact_map_size = size;
+    return true;
+  }
+
+  bool set_keep_exact(bool keep, char** error=NULL) {
+    // Keeps a full precision copy of every item next to the reduced
+    // precision nodes, to rescore the best candidates of each query against
+    // and for save_exact. The copies take as much memory as the items of a
+    // float index, so they are off by default. Call before adding items.
+    const char* msg = NULL;
+    if (_loaded || _n_items > 0)
+      msg = "Full precision copies have to be asked for before adding items";
+    else if (keep && VectorStorage<V>::exact)
+      msg = "The nodes already hold the vectors in full precision";
+    if (msg) {
+      showUpdate("%s\n", msg);
+      if (error) *error = (char *)msg;
+      return false;
+    }
+    _keep_exact = keep;
+    return true;
+  }
+
+  void set_rescore_factor(size_t factor) {
+    // Rescore the best factor * n candidates when full precision vectors are
+    // available. 0 turns rescoring off.
+    _rescore_factor = factor;
+  }
+
+  bool set_split_options(int iterations, int sample_size, char** error=NULL) {
+    // The split planes come from iterations updates of two means, each of
+    // which assigns sample_size random points. A sample_size of 1 is the
+    // classic algorithm, one point at a time; larger samples are scored and
+    // folded into the centroids in batches.
+    const char* msg = NULL;
+    if (iterations < 0)
+      msg = "The number of iterations can't be negative";
+    else if (sample_size < 1 || sample_size > 1024)
+      msg = "The sample size has to be between 1 and 1024";
+    if (msg) {
+      showUpdate("%s\n", msg);
+      if (error) *error = (char *)msg;
+      return false;
+    }
+    _split_options.iterations = iterations;
+    _split_options.sample_size = sample_size;
+    return true;
+  }
+
+  void reinitialize() {
+    _fd = 0;
+    _nodes = NULL;
+    _loaded = false;
+    _n_items = 0;
+    _n_nodes = 0;
+    _nodes_size = 0;
+    _on_disk = false;
+    _roots.clear();
+    _exact_map = NULL;
+    _exact_map_size = 0;
+    _node_offset = 0;
+    _leaf_first = numeric_limits<S>::max();
+    _split_first = numeric_limits<S>::max();
+    _leaves = NULL;
+    _splits = NULL;
+    _header_bytes = 0;
+    _file_map = NULL;
+    _mapped_size = 0;
+    _load_memory = ANNOY_LOAD_MAPPED;
+    _ids.clear();
+    _external_ids = NULL;
+    _internal_ids = NULL;
+  }
+
+  void unload() {
+#ifdef ANNOY_MULTITHREADED_BUILD
+    wait_warmup(); // It reads the mapping
+#endif
+    if (_on_disk && _fd) {
+      close(_fd);
+      _arena.release();
+    } else {
+      if (_fd) {
+        // we have mmapped data, or a copy of it in the arena
+        close(_fd);
+        if (_arena.data())
+          _arena.release();
+        else
+          munmap(_file_map, _mapped_size);
+      } else {
+        // We have heap allocated data
+        _arena.release();
+      }
+    }
+    if (_exact_map)
+      munmap(_exact_map, _exact_map_size);
+    _exact_items.clear();
+    _pq.clear();
+    reinitialize();
+    if (_verbose) showUpdate("unloaded\n");
+  }
+
+  bool load(const char* filename, bool prefault=false, char** error=NULL) {
+    LoadOptions options;
+    options.prefault = prefault;
+    return load(filename, options, error);
+  }
+
+  bool load(const char* filename, const LoadOptions& options, char** error=NULL) {
+    _fd = open(filename, O_RDONLY, (int)0400);
+    if (_fd == -1) {
+      showUpdate("Error: file descriptor is -1\n");
+      if (error) *error = strerror(errno);
+      _fd = 0;
+      return false;
+    }
+    off_t size = lseek(_fd, 0, SEEK_END);
+    if (size == -1) {
+      showUpdate("lseek returned -1\n");
+      if (error) *error = strerror(errno);
+      _abort_load(false);
+      return false;
+    } else if (size == 0) {
+      showUpdate("Size of file is zero\n");
+      if (error) *error = (char *)"Size of file is zero";
+      _abort_load(false);
+      return false;
+    }
+    IndexHeader header;
+    const bool versioned = (size_t)size >= sizeof(header)
+      && pread(_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+      && memcmp(header.magic, "ANNOYIDX", 8) == 0;
+    if (versioned && header.version < 2) {
+      // The nodes were always flat
+      header.n_leaves = 0;
+      header.leaves_offset = header.splits_offset
+        = header.nodes_offset + (header.n_items - header.node_offset) * _s;
+      header.section_size = 0;
+    }
+    if (versioned && header.version < 3)
+      header.ids_offset = 0;
+    if (versioned && header.version < 4)
+      header.leaf_size = 0;
+    const char* msg = versioned ? _check_header(header, size) : NULL;
+    if (msg) {
+      showUpdate("Error: %s\n", msg);
+      if (error) *error = (char *)msg;
+      _abort_load(false);
+      return false;
+    }
+    typename ProductQuantizer<S, T>::Footer footer;
+    bool quantized = !versioned && _read_footer(size, &footer);
+    if (!versioned && !quantized && size % _s) {
+      // Something is fishy with this index!
+      showUpdate("Error: index size %zu is not a multiple of vector size %zu\n", (size_t)size, (size_t)_s);
+      if (error) *error = (char *)"Index size is not a multiple of vector size";
+      _abort_load(false);
+      return false;
+    }
+
+    if (!_map_index(size, options)) {
+      showUpdate("Error: unable to load %s: %s\n", filename, strerror(errno));
+      if (error) *error = strerror(errno);
+      _abort_load(false); // _map_index() cleaned up after itself
+      return false;
+    }
+    _nodes = _file_map;
+    if (versioned) {
+      // Everything is in the header, nothing else needs to be read
+      const char* base = (const char*)_file_map;
+      _nodes = (char*)_file_map + header.nodes_offset;
+      _node_offset = (S)header.node_offset;
+      _n_items = (S)header.n_items;
+      _n_nodes = (S)header.n_nodes;
+      _leaf_size = (S)header.leaf_size;
+      _roots.assign((const S*)(base + header.roots_offset), (const S*)(base + header.roots_offset) + header.n_roots);
+      if (header.ids_offset) {
+        _external_ids = (const S*)(base + header.ids_offset);
+        _internal_ids = _external_ids + _n_items;
+      }
+      const uint64_t items_end = header.nodes_offset + (header.n_items - header.node_offset) * _s;
+      if (header.leaves_offset != items_end || header.splits_offset != header.leaves_offset + header.n_leaves * _s) {
+        _leaf_first = _n_items;
+        _split_first = _n_items + (S)header.n_leaves;
+        _leaves = base + header.leaves_offset;
+        _splits = base + header.splits_offset;
+      }
+#ifdef MADV_HUGEPAGE
+      if (header.section_size) {
+        // Each section on its own, they start on 2MB boundaries of the file and of the mapping
+        madvise((char*)base + header.nodes_offset, header.leaves_offset - header.nodes_offset, MADV_HUGEPAGE);
+        madvise((char*)base + header.leaves_offset, header.splits_offset - header.leaves_offset, MADV_HUGEPAGE);
+        madvise((char*)base + header.splits_offset, header.roots_offset - header.splits_offset, MADV_HUGEPAGE);
+      }
+#endif
+      if (header.pq_m) {
+        _pq.configure(_f, header.pq_m, header.pq_nbits);
+        _pq.attach(base + header.codes_offset, base + header.norms_offset, base + header.centroids_offset, _node_offset);
+      }
+      _loaded = true;
+      _built = true;
+      if (_verbose) showUpdate("found %zu roots, %zu items\n", _roots.size(), (size_t)_n_items);
+      return true;
+    }
+
+    // Files without a header
+    _leaf_size = 0;
+    if ((uint64_t)(size / _s) > (uint64_t)numeric_limits<S>::max()) {
+      showUpdate("Error: index has more nodes than the node ids can number\n");
+      if (error) *error = (char *)"Index has more nodes than the node ids can number";
+      _abort_load(true);
+      return false;
+    }
+    _n_nodes = (S)(size / _s);
+    if (quantized) {
+      // The items are not in the file, the nodes start at n_items
+      _node_offset = (S)footer.n_items;
+      _n_nodes = (S)footer.n_nodes;
+      _pq.configure(_f, footer.m, footer.nbits);
+      _pq.attach((char*)_nodes + footer.codes_offset, (char*)_nodes + footer.norms_offset,
+                 (char*)_nodes + footer.centroids_offset, _node_offset);
+    }
+
+    // Find the roots by scanning the end of the file and taking the nodes with most descendants
+    _roots.clear();
+    S m = 0;
+    for (S i = _n_nodes; i-- > _node_offset; ) { // Also for unsigned S
+      S k = _get(i)->n_descendants;
+      if (_roots.empty() || k == m) {
+        _roots.push_back(i);
+        m = k;
+      } else {
+        break;
+      }
+    }
+    // hacky fix: since the last root precedes the copy of all roots, delete it
+    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
+      _roots.pop_back();
+    _loaded = true;
+    _built = true;
+    _n_items = m;
+    if (_verbose) showUpdate("found %zu roots with degree %zu\n", _roots.size(), (size_t)m);
+    return true;
+  }
+
+#ifdef ANNOY_MULTITHREADED_BUILD
+  bool warmup(const WarmupOptions& options, WarmupStats* stats=NULL, char** error=NULL) {
+    // Brings a loaded index into memory ahead of the queries, the way the
+    // options say, and returns when all of it is there
+    if (!_loaded) {
+      showUpdate("Error: only loaded indexes can be warmed\n");
+      if (error) *error = (char *)"Only loaded indexes can be warmed";
+      return false;
+    }
+    WarmupState state;
+    _warm(&state, options);
+    if (stats) *stats = state.stats;
+    return true;
+  }
+
+  bool warmup_in_background(const WarmupOptions& options, char** error=NULL) {
+    // Same as warmup() on a thread of its own, so that queries can be served
+    // while the index is warming. get_warmed_bytes() follows the progress and
+    // wait_warmup() waits for the end; unload() waits for it too.
+    if (!_loaded || _warmup) {
+      const char* msg = _warmup ? "Index is already warming" : "Only loaded indexes can be warmed";
+      showUpdate("Error: %s\n", msg);
+      if (error) *error = (char *)msg;
+      return false;
+    }
+    _warmup = new WarmupState();
+    _warmup->thread = std::thread(&AnnoyIndex::_warm, this, _warmup, options);
+    return true;
   }
 
-};
-
-struct Manhattan : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return manhattan_distance(x->v, y->v, f);
+  size_t get_warmed_bytes() const {
+    // Of the warmup_in_background() going on
+    return _warmup ? _warmup->warmed.load() : 0;
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  bool wait_warmup(WarmupStats* stats=NULL) {
+    // Waits for warmup_in_background(), false if nothing was warming
+    if (!_warmup)
+      return false;
+    _warmup->thread.join();
+    if (stats) *stats = _warmup->stats;
+    delete _warmup;
+    _warmup = NULL;
+    return true;
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return std::max(distance, T(0));
+#endif
+
+  T get_distance(S i, S j) const {
+    i = _to_internal(i);
+    j = _to_internal(j);
+    if (_pq.ready()) {
+      // Same as a query for item i that only scores j
+      T* v = (T*)alloca(_f * sizeof(T));
+      T d;
+      _get_item(i, v);
+      _pq.template distances<D>(v, &j, 1, &d);
+      return D::normalized_distance(d);
+    }
+    FullNode* x = (FullNode*)alloca(_fs);
+    _load(x, _get(i));
+    return D::normalized_distance(D::distance(x, _get(j), _f));
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+
+  void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    // TODO: handle OOB
+    T* v = (T*)alloca(_f * sizeof(T));
+    _get_item(_to_internal(item), v);
+    _get_all_nns(v, n, search_k, result, distances);
   }
-  static const char* name() {
-    return "manhattan";
+
+  void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    _get_all_nns(w, n, search_k, result, distances);
   }
-};
 
-template<typename S, typename T>
-class AnnoyIndexInterface {
- public:
-  virtual ~AnnoyIndexInterface() {};
-  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
-  virtual bool build(int q, char** error=NULL) = 0;
-  virtual bool unbuild(char** error=NULL) = 0;
-  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual void unload() = 0;
-  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual T get_distance(S i, S j) const = 0;
-  virtual void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual S get_n_items() const = 0;
-  virtual S get_n_trees() const = 0;
-  virtual void verbose(bool v) = 0;
-  virtual void get_item(S item, T* v) const = 0;
-  virtual void set_seed(int q) = 0;
-  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
-};
+  S get_n_items() const {
+    return _n_items;
+  }
 
-template<typename S, typename T, typename Distance, typename Random>
-  class AnnoyIndex : public AnnoyIndexInterface<S, T> {
-  /*
-   * We use random projection to build a forest of binary trees of all items.
-   * Basically just split the hyperspace into two sides by a hyperplane,
-   * then recursively split each of those subtrees etc.
-   * We create a tree like this q times. The default q is determined automatically
-   * in such a way that we at most use 2x as much memory as the vectors take.
-   */
-public:
-  typedef Distance D;
-  typedef typename D::template Node<S, T> Node;
+  S get_n_trees() const {
+    return _roots.size();
+  }
 
-protected:
-  const int _f;
-  size_t _s;
-  S _n_items;
-  Random _random;
-  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
-  S _n_nodes;
-  S _nodes_size;
-  vector<S> _roots;
-  S _K;
-  bool _loaded;
-  bool _verbose;
-  int _fd;
-  bool _on_disk;
-  bool _built;
-public:
+  void verbose(bool v) {
+    _verbose = v;
+  }
 
-   AnnoyIndex(int f) : _f(f), _random() {
-    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
-    _verbose = false;
-    _built = false;
-    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
-    reinitialize(); // Reset everything
+  void get_item(S item, T* v) const {
+    // TODO: handle OOB
+    _get_item(_to_internal(item), v);
   }
-  ~AnnoyIndex() {
-    unload();
+
+  void set_seed(int seed) {
+    _random.set_seed(seed);
+    _seed = seed;
   }
 
-  int get_f() const {
-    return _f;
+protected:
+  bool _allocate_size(S n) {
+    if (n > _nodes_size) {
+      void *old = _nodes;
+      // Rounded up to whole chunks of memory, or extents of the file
+      void* nodes = _arena.grow(_header_bytes + _s * (size_t)n);
+      if (!nodes) {
+        showUpdate("Unable to allocate %zu bytes for the nodes: %s\n", _s * (size_t)n, strerror(errno));
+        return false;
+      }
+      _nodes = (char*)nodes + _header_bytes;
+      S new_nodes_size = (S)std::min((_arena.committed() - _header_bytes) / _s, (size_t)numeric_limits<S>::max());
+      _nodes_size = new_nodes_size;
+      if (_verbose) showUpdate("Reallocating to %zu nodes: old_address=%p, new_address=%p\n", (size_t)new_nodes_size, old, _nodes);
+    }
+    return true;
   }
 
-  bool add_item(S item, const T* w, char** error=NULL) {
-    return add_item_impl(item, w, error);
+  void _write_back(S n_nodes, bool drop, bool force) {
+    // Writes back the nodes before n_nodes that haven't been, once there
+    // are enough of them (see set_on_disk_writeback)
+    const size_t end = (size_t)n_nodes * _s;
+    if (!_on_disk || _writeback == ANNOY_WRITEBACK_NONE || end <= _written_back)
+      return;
+    if (end - _written_back < _writeback_interval && !force)
+      return;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    const size_t page = 4096;
+#else
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    const size_t begin = _written_back & ~(page - 1);
+    char* p = (char*)_nodes + begin;
+    msync(p, end - begin, MS_SYNC);
+#ifdef MADV_DONTNEED
+    if (drop && _writeback == ANNOY_WRITEBACK_DONTNEED)
+      madvise(p, end - begin, MADV_DONTNEED); // Clean now, so this only unmaps them
+#endif
+    _written_back = end;
   }
 
   template<typename W>
-  bool add_item_impl(S item, const W& w, char** error=NULL) {
-    if (_loaded) {
-      showUpdate("You can't add an item to a loaded index\n");
-      if (error) *error = (char *)"You can't add an item to a loaded index";
-      return false;
-    }
-    _allocate_size(item + 1);
-    Node* n = _get(item);
+  void _add(S item, const W& w) {
+    // Writes item, for which the nodes (and _exact_items, if kept) have been
+    // allocated
+    Node* m = _get(item);
+    FullNode* n = (FullNode*)alloca(_fs);
 
+    memset(n, 0, offsetof(FullNode, v)); // Saved as is, so don't leave stack garbage in unused fields
     D::zero_value(n);
 
     n->children[0] = 0;
@@ -872,386 +4821,1258 @@ public:
     for (int z = 0; z < _f; z++)
       n->v[z] = w[z];
 
-    D::init_node(n, _f);
+    D::init_node(n, _f); // May change the vector, see NormalizedAngular
+    _store(m, n);
+    if (!VectorStorage<V>::exact) {
+      // Keep the original for rescoring if asked to, then initialize the
+      // node from the vector that was actually stored
+      if (_keep_exact)
+        memcpy(&_exact_items[(size_t)item * _f], n->data(), _f * sizeof(T));
+      _load(n, m);
+      D::init_node(n, _f);
+      memcpy(m, n, offsetof(Node, v));
+    }
+  }
 
-    if (item >= _n_items)
-      _n_items = item + 1;
+  template<typename W>
+  void _add_rows(const char* rows, size_t stride, S first_id, S begin, S end) {
+    // Rows begin .. end - 1 of add_items_impl, run by one thread each
+    for (S i = begin; i < end; i++)
+      _add(first_id + i, (const W*)(rows + (size_t)i * stride));
+  }
 
-    return true;
+  static bool _has_suffix(const char* s, const char* suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
   }
-    
-  bool on_disk_build(const char* file, char** error=NULL) {
-    _on_disk = true;
-    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
-    if (_fd == -1) {
-      showUpdate("Error: file descriptor is -1\n");
-      if (error) *error = strerror(errno);
-      _fd = 0;
-      return false;
+
+  inline Node* _get(const S i) const {
+    if (i < _leaf_first) // Always, unless the index was loaded from a sectioned file
+      return get_node_ptr<S, Node>(_nodes, _s, i - _node_offset);
+    if (i < _split_first)
+      return get_node_ptr<S, Node>(_leaves, _s, i - _leaf_first);
+    return get_node_ptr<S, Node>(_splits, _s, i - _split_first);
+  }
+
+  void _store(Node* dest, const FullNode* source) const {
+    // The header fields are laid out the same in both
+    memcpy(dest, source, offsetof(Node, v));
+    encode_vector(source->data(), _f, dest->data());
+  }
+
+  void _load(FullNode* dest, const Node* source) const {
+    memcpy(dest, source, offsetof(Node, v));
+    decode_vector(source->data(), _f, dest->data());
+  }
+
+  bool _has_exact() const {
+    return _exact_map || !_exact_items.empty();
+  }
+
+  void _get_item(S item, T* v) const {
+    // get_item() of an internal id
+    if (_has_exact())
+      memcpy(v, _get_exact(item), (_f) * sizeof(T));
+    else if (item < _node_offset)
+      _pq.decode(item, v); // Only the codes were loaded
+    else
+      decode_vector(_get(item)->data(), _f, v);
+  }
+
+  S _to_internal(S item) const {
+    return _internal_ids ? _internal_ids[item] : item;
+  }
+
+  S _to_external(S item) const {
+    return _external_ids ? _external_ids[item] : item;
+  }
+
+  S _max_leaf() const {
+    // Tree nodes with at most this many descendants are leaves
+    return _leaf_size ? _leaf_size : _K;
+  }
+
+  S _run(S i) const {
+    // How many nodes from i on go together: a fat leaf and the copies of
+    // its items behind it, or just node i
+    return _leaf_size && i >= _n_items && _get(i)->n_descendants <= _leaf_size ? 1 + _get(i)->n_descendants : 1;
+  }
+
+  Node* _fat_item(const Node* leaf, S k) const {
+    // The copy of item k of a fat leaf, whose n_descendants is the id of
+    // the item instead
+    return (Node*)((const char*)leaf + (size_t)(k + 1) * _s);
+  }
+
+  S _leaf_item(const Node* leaf, S k) const {
+    if (_leaf_size)
+      return _fat_item(leaf, k)->n_descendants;
+    const S* dst = leaf->ids();
+    return dst[k];
+  }
+
+  void _reorder_by_leaves() {
+    // See set_reorder_items(). The items come in the order of a depth first
+    // walk of the first tree, the ones it doesn't have (never added) last.
+    vector<S> order;
+    order.reserve(_n_items);
+    vector<bool> placed(_n_items, false);
+    vector<S> stack(_roots.begin(), _roots.begin() + std::min((size_t)1, _roots.size()));
+    while (!stack.empty()) {
+      const S i = stack.back();
+      stack.pop_back();
+      const Node* nd = _get(i);
+      if (i < _n_items) {
+        if (!placed[i])
+          order.push_back(i), placed[i] = true;
+      } else if (nd->n_descendants <= _max_leaf()) { // A leaf
+        for (S k = 0; k < nd->n_descendants; k++) {
+          const S j = _leaf_item(nd, k);
+          if (!placed[j])
+            order.push_back(j), placed[j] = true;
+        }
+      } else {
+        stack.push_back(nd->children[1]);
+        stack.push_back(nd->children[0]);
+      }
     }
-    _nodes_size = 1;
-    if (ftruncate(_fd, _s * _nodes_size) == -1) {
-      showUpdate("Error truncating file: %s\n", strerror(errno));
-      if (error) *error = strerror(errno);
-      return false;
+    for (S i = 0; i < _n_items; i++) {
+      if (!placed[i])
+        order.push_back(i);
     }
-#ifdef MAP_POPULATE
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
-#else
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
-#endif
-    return true;
-  }
-    
-  bool build(int q, char** error=NULL) {
-    if (_loaded) {
-      showUpdate("You can't build a loaded index\n");
-      if (error) *error = (char *)"You can't build a loaded index";
-      return false;
+    _permute_items(order);
+    _ids.resize(2 * (size_t)_n_items);
+    for (S k = 0; k < _n_items; k++) {
+      _ids[k] = order[k];
+      _ids[(size_t)_n_items + order[k]] = k;
     }
+    _external_ids = &_ids[0];
+    _internal_ids = &_ids[_n_items];
+  }
 
-    if (_built) {
-      showUpdate("You can't build a built index\n");
-      if (error) *error = (char *)"You can't build a built index";
-      return false;
+  void _permute_items(const vector<S>& order) {
+    // Moves item order[k] to k, one cycle of the permutation at a time so
+    // that only one node is held aside, and renumbers the items in the trees
+    vector<bool> done(_n_items, false);
+    Node* held = (Node*)alloca(_s);
+    vector<T> held_exact(_exact_items.empty() ? 0 : _f);
+    for (S k = 0; k < _n_items; k++) {
+      if (done[k])
+        continue;
+      memcpy(held, _get(k), _s);
+      if (!held_exact.empty())
+        memcpy(&held_exact[0], &_exact_items[(size_t)k * _f], _f * sizeof(T));
+      for (S j = k; ; ) {
+        done[j] = true;
+        const S from = order[j];
+        const bool last = from == k;
+        memcpy(_get(j), last ? held : _get(from), _s);
+        if (!held_exact.empty())
+          memcpy(&_exact_items[(size_t)j * _f], last ? &held_exact[0] : &_exact_items[(size_t)from * _f], _f * sizeof(T));
+        if (last)
+          break;
+        j = from;
+      }
     }
+    vector<S> moved(_n_items);
+    for (S k = 0; k < _n_items; k++)
+      moved[order[k]] = k;
+    for (S i = _n_items; i < _n_nodes; i += _run(i)) {
+      Node* m = _get(i);
+      if (m->n_descendants <= _max_leaf()) {
+        for (S k = 0; k < m->n_descendants; k++) {
+          if (_leaf_size) {
+            _fat_item(m, k)->n_descendants = moved[_fat_item(m, k)->n_descendants];
+          } else {
+            S* dst = m->ids();
+            dst[k] = moved[dst[k]];
+          }
+        }
+      } else {
+        for (int side = 0; side < 2; side++)
+          if (m->children[side] < _n_items)
+            m->children[side] = moved[m->children[side]];
+      }
+    }
+  }
 
-    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+  const T* _get_exact(S item) const {
+    if (_exact_map)
+      return (const T*)_exact_map + (size_t)item * _f;
+    return &_exact_items[(size_t)item * _f];
+  }
 
-    _n_nodes = _n_items;
-    while (1) {
-      if (q == -1 && _n_nodes >= _n_items * 2)
-        break;
-      if (q != -1 && _roots.size() >= (size_t)q)
-        break;
-      if (_verbose) showUpdate("pass %zd...\n", _roots.size());
+  void _quantize() {
+    // Trains the quantizer on a sample of the items, then encodes all of them
+    vector<T> items((size_t)_n_items * _f);
+    for (S i = 0; i < _n_items; i++) {
+      decode_vector(_get(i)->data(), _f, &items[(size_t)i * _f]);
+      D::adc_prepare(&items[(size_t)i * _f], _f);
+    }
+    size_t n_sample = std::min((size_t)_n_items, std::max((size_t)64 << _pq.nbits(), (size_t)16384));
+    vector<T> sample(n_sample * _f);
+    for (size_t i = 0; i < n_sample; i++) {
+      size_t k = n_sample < (size_t)_n_items ? _random.index(_n_items) : i;
+      memcpy(&sample[i * _f], &items[k * _f], _f * sizeof(T));
+    }
+    if (_verbose) showUpdate("training %d subspaces on %zu items\n", _pq.m(), n_sample);
+    _pq.train(&sample[0], n_sample, _random);
+    _pq.allocate(_n_items);
+    _pq.encode_all(&items[0], _n_items);
+  }
 
-      vector<S> indices;
-      for (S i = 0; i < _n_items; i++) {
-        if (_get(i)->n_descendants >= 1) // Issue #223
-          indices.push_back(i);
-      }
+  static uint64_t _align_up(uint64_t x, uint64_t alignment) {
+    return (x + alignment - 1) / alignment * alignment;
+  }
 
-      _roots.push_back(_make_tree(indices, true));
+  void _fill_header(IndexHeader* header, S n_leaves, uint64_t section_size) const {
+    // Lays out the file: the header, the items, the leaves, the splits, the
+    // roots and, if the items are quantized, their codes, norms and
+    // centroids. Flat files (section_size 0) only align the last four to 64
+    // bytes.
+    const uint64_t alignment = section_size ? section_size : 64;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "ANNOYIDX", 8);
+    header->version = ANNOY_INDEX_VERSION;
+    header->f = _f;
+    strncpy(header->metric, D::name(), sizeof(header->metric) - 1);
+    strncpy(header->storage, VectorStorage<V>::name(), sizeof(header->storage) - 1);
+    header->s_size = sizeof(S);
+    header->t_size = sizeof(T);
+    header->node_size = (uint32_t)_s;
+    header->K = (uint32_t)_K;
+    header->leaf_size = _leaf_size;
+    header->n_items = _n_items;
+    header->n_nodes = _n_nodes;
+    header->n_roots = _roots.size();
+    header->n_leaves = n_leaves;
+    header->section_size = section_size;
+    header->node_offset = _pq.ready() ? _n_items : 0;
+    header->nodes_offset = section_size ? section_size : (uint64_t)ANNOY_HEADER_SIZE;
+    uint64_t end = header->nodes_offset + (header->n_items - header->node_offset) * _s;
+    header->leaves_offset = section_size ? _align_up(end, section_size) : end;
+    end = header->leaves_offset + header->n_leaves * _s;
+    header->splits_offset = section_size ? _align_up(end, section_size) : end;
+    end = header->splits_offset + (header->n_nodes - header->n_items - header->n_leaves) * _s;
+    header->roots_offset = _align_up(end, alignment);
+    end = header->roots_offset + header->n_roots * sizeof(S);
+    if (_external_ids) {
+      header->ids_offset = _align_up(end, alignment);
+      end = header->ids_offset + 2 * header->n_items * sizeof(S);
     }
+    if (_pq.ready()) {
+      header->pq_m = _pq.m();
+      header->pq_nbits = _pq.nbits();
+      header->codes_offset = _align_up(end, alignment);
+      header->norms_offset = _align_up(header->codes_offset + _pq.codes_size(), alignment);
+      header->centroids_offset = _align_up(header->norms_offset + (size_t)_n_items * sizeof(T), alignment);
+      end = header->centroids_offset + _pq.centroids_size();
+    }
+    header->file_size = section_size ? _align_up(end, section_size) : end;
+  }
 
-    // Also, copy the roots into the last segment of the array
-    // This way we can load them faster without reading the whole file
-    _allocate_size(_n_nodes + (S)_roots.size());
-    for (size_t i = 0; i < _roots.size(); i++)
-      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
-    _n_nodes += _roots.size();
+  struct Segment {
+    // A run of bytes of a saved index, which is in one piece in memory
+    uint64_t offset; // In the file
+    const char* data;
+    size_t size;
+    bool renumber; // Splits whose children are renumbered on the way, see ANNOY_LAYOUT_SECTIONED
+  };
 
-    if (_verbose) showUpdate("has %d nodes\n", _n_nodes);
-    
-    if (_on_disk) {
-      _nodes = remap_memory(_nodes, _fd, _s * _nodes_size, _s * _n_nodes);
-      if (ftruncate(_fd, _s * _n_nodes)) {
-	// TODO: this probably creates an index in a corrupt state... not sure what to do
-	showUpdate("Error truncating file: %s\n", strerror(errno));
-	if (error) *error = strerror(errno);
-	return false;
+  static bool _segment_before(uint64_t offset, const Segment& segment) {
+    return offset < segment.offset;
+  }
+
+  static void _add_segment(vector<Segment>* segments, uint64_t offset, const void* data, size_t size, bool renumber) {
+    // Extends the last segment if this one continues it in the file and in memory
+    if (!size)
+      return;
+    if (!segments->empty()) {
+      Segment& last = segments->back();
+      if (last.renumber == renumber && last.offset + last.size == offset && last.data + last.size == (const char*)data) {
+        last.size += size;
+        return;
       }
-      _nodes_size = _n_nodes;
     }
-    _built = true;
-    return true;
+    Segment segment = {offset, (const char*)data, size, renumber};
+    segments->push_back(segment);
   }
-  
-  bool unbuild(char** error=NULL) {
-    if (_loaded) {
-      showUpdate("You can't unbuild a loaded index\n");
-      if (error) *error = (char *)"You can't unbuild a loaded index";
-      return false;
-    }
 
-    _roots.clear();
-    _n_nodes = _n_items;
-    _built = false;
+  bool _is_split(S i) const {
+    return i >= _n_items && _get(i)->n_descendants > _max_leaf();
+  }
 
-    return true;
+  void _order_nodes(vector<S>* order, S* n_leaves) const {
+    // The tree nodes in the order of a sectioned file, the leaves before the
+    // splits. ANNOY_LAYOUT_SECTIONED keeps the order of their ids.
+    // ANNOY_LAYOUT_BLOCKED takes the leaves of each tree from left to right
+    // and the splits from _block_splits(); the copies of the roots, which no
+    // tree reaches, come last. Fat leaves stay in one piece with their
+    // copies.
+    vector<S> leaves, splits;
+    vector<bool> placed(_n_nodes - _n_items, false);
+    if (_layout == ANNOY_LAYOUT_BLOCKED) {
+      _block_trees(&splits);
+      for (size_t k = 0; k < splits.size(); k++)
+        placed[splits[k] - _n_items] = true;
+      vector<S> stack;
+      for (size_t t = 0; t < _roots.size(); t++) {
+        stack.push_back(_roots[t]);
+        while (!stack.empty()) {
+          const S i = stack.back();
+          stack.pop_back();
+          if (i < _n_items) {
+            continue;
+          } else if (_is_split(i)) {
+            stack.push_back(_get(i)->children[1]);
+            stack.push_back(_get(i)->children[0]);
+          } else if (!placed[i - _n_items]) {
+            for (S k = 0, run = _run(i); k < run; k++) {
+              leaves.push_back(i + k);
+              placed[i + k - _n_items] = true;
+            }
+          }
+        }
+      }
+    }
+    for (S i = _n_items; i < _n_nodes; i += _run(i)) {
+      if (placed[i - _n_items])
+        continue;
+      if (_is_split(i))
+        splits.push_back(i);
+      else
+        for (S k = 0, run = _run(i); k < run; k++)
+          leaves.push_back(i + k);
+    }
+    *n_leaves = (S)leaves.size();
+    order->swap(leaves);
+    order->insert(order->end(), splits.begin(), splits.end());
   }
 
-  bool save(const char* filename, bool prefault=false, char** error=NULL) {
-    if (!_built) {
-      showUpdate("You can't save an index that hasn't been built\n");
-      if (error) *error = (char *)"You can't save an index that hasn't been built";
-      return false;
+  void _block_trees(vector<S>* order) const {
+    // Block sizes in nodes, from 2MB pages down to cache lines, leaving
+    // out the ones that hold a single node
+    vector<size_t> caps;
+    const size_t bytes[] = {NodeArena::chunk_size, 4096, 64};
+    size_t page = 0; // Level of the 4KB blocks
+    for (size_t k = 0; k < 3; k++) {
+      if (bytes[k] / _s > 1 && (caps.empty() || bytes[k] / _s < caps.back())) {
+        if (bytes[k] == 4096)
+          page = caps.size();
+        caps.push_back(bytes[k] / _s);
+      }
     }
-    if (_on_disk) {
-      return true;
-    } else {
-      // Delete file if it already exists (See issue #335)
-      unlink(filename);
+    if (caps.empty())
+      caps.push_back(1);
+    // Every query goes through the top of every tree, so those come first,
+    // a 4KB block of each, next to each other. Then the trees below them.
+    vector<vector<S> > below(_roots.size());
+    for (size_t t = 0; t < _roots.size(); t++) {
+      if (_is_split(_roots[t]))
+        _block_splits(_roots[t], caps, page, _block_levels(_roots[t], caps[page], (size_t)-1, &below[t]), order);
+    }
+    for (size_t t = 0; t < _roots.size(); t++) {
+      for (size_t k = 0; k < below[t].size(); k++)
+        _block_splits(below[t][k], caps, 0, (size_t)-1, order);
+    }
+  }
+
+  size_t _block_levels(S root, size_t cap, size_t max_depth, vector<S>* below) const {
+    // How many levels of splits from root fit into cap nodes, at least one
+    // and at most max_depth. below gets the splits of the level after them.
+    vector<S> level(1, root), next;
+    size_t depth = 0, total = 0;
+    while (!level.empty() && depth < max_depth && (depth == 0 || total + level.size() <= cap)) {
+      total += level.size();
+      depth++;
+      next.clear();
+      for (size_t k = 0; k < level.size(); k++) {
+        for (int side = 0; side < 2; side++) {
+          const S c = _get(level[k])->children[side];
+          if (_is_split(c))
+            next.push_back(c);
+        }
+      }
+      level.swap(next);
+    }
+    below->swap(level);
+    return depth;
+  }
 
-      printf("path: %s\n", filename);
+  void _block_splits(S root, const vector<size_t>& caps, size_t l, size_t max_depth, vector<S>* order) const {
+    // Appends the splits of the subtree at root down to max_depth levels:
+    // the levels that fit into a block of caps[l] nodes, laid out in blocks
+    // of the next size, then the subtrees below them (van Emde Boas with
+    // the heights cut at the block sizes instead of in halves)
+    vector<S> below;
+    if (l == caps.size()) {
+      // Within a cache line the order doesn't matter
+      vector<S> level(1, root);
+      for (size_t depth = 0; !level.empty() && depth < max_depth; depth++) {
+        order->insert(order->end(), level.begin(), level.end());
+        below.clear();
+        for (size_t k = 0; k < level.size(); k++) {
+          for (int side = 0; side < 2; side++) {
+            const S c = _get(level[k])->children[side];
+            if (_is_split(c))
+              below.push_back(c);
+          }
+        }
+        level.swap(below);
+      }
+      return;
+    }
+    const size_t depth = _block_levels(root, caps[l], max_depth, &below);
+    _block_splits(root, caps, l + 1, depth, order);
+    if (depth < max_depth) {
+      for (size_t k = 0; k < below.size(); k++)
+        _block_splits(below[k], caps, l, max_depth - depth, order);
+    }
+  }
 
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL) {
-        showUpdate("Unable to open: %s\n", strerror(errno));
-        if (error) *error = strerror(errno);
-        return false;
+  void _plan_index(IndexHeader* header, vector<S>* renumbered, vector<S>* roots, vector<Segment>* segments) const {
+    // Lays out the file (see _fill_header) as the segments to write, in
+    // the order of their offsets; the gaps between them are zeros
+    const bool sectioned = _layout != ANNOY_LAYOUT_FLAT;
+    // Sectioned files number the leaves before the splits
+    S n_leaves = 0;
+    vector<S> order;
+    renumbered->clear();
+    if (sectioned) {
+      _order_nodes(&order, &n_leaves);
+      renumbered->resize(_n_nodes - _n_items);
+      for (size_t k = 0; k < order.size(); k++)
+        (*renumbered)[order[k] - _n_items] = _n_items + (S)k;
+    }
+    _fill_header(header, n_leaves, sectioned ? NodeArena::chunk_size : 0);
+    segments->clear();
+    _add_segment(segments, 0, header, sizeof(*header), false);
+    for (S i = (S)header->node_offset; i < _n_items; i++)
+      _add_segment(segments, header->nodes_offset + (uint64_t)(i - header->node_offset) * _s, _get(i), _s, false);
+    roots->assign(_roots.begin(), _roots.end());
+    if (sectioned) {
+      for (size_t k = 0; k < order.size(); k++) {
+        const bool split = k >= (size_t)n_leaves;
+        const uint64_t offset = split ? header->splits_offset + (k - n_leaves) * _s : header->leaves_offset + k * _s;
+        _add_segment(segments, offset, _get(order[k]), _s, split);
       }
+      for (size_t i = 0; i < roots->size(); i++)
+        (*roots)[i] = (*renumbered)[(*roots)[i] - _n_items];
+    } else {
+      for (S i = _n_items; i < _n_nodes; i++)
+        _add_segment(segments, header->splits_offset + (uint64_t)(i - _n_items) * _s, _get(i), _s, false);
+    }
+    _add_segment(segments, header->roots_offset, roots->empty() ? NULL : &(*roots)[0], roots->size() * sizeof(S), false);
+    if (_external_ids) {
+      _add_segment(segments, header->ids_offset, _external_ids, (size_t)_n_items * sizeof(S), false);
+      _add_segment(segments, header->ids_offset + (uint64_t)_n_items * sizeof(S), _internal_ids, (size_t)_n_items * sizeof(S), false);
+    }
+    if (_pq.ready()) {
+      _add_segment(segments, header->codes_offset, _pq.codes(), _pq.codes_size(), false);
+      _add_segment(segments, header->norms_offset, _pq.norms(), (size_t)_n_items * sizeof(T), false);
+      _add_segment(segments, header->centroids_offset, _pq.centroids(), _pq.centroids_size(), false);
+    }
+  }
 
-      if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
-        showUpdate("Unable to write: %s\n", strerror(errno));
-        if (error) *error = strerror(errno);
-        return false;
+  void _gather(const vector<Segment>& segments, const vector<S>& renumbered, uint64_t offset, size_t size, char* buffer) const {
+    // Copies the bytes of the file at offset into buffer, which is zero
+    typename vector<Segment>::const_iterator it = std::upper_bound(segments.begin(), segments.end(), offset, _segment_before);
+    if (it != segments.begin())
+      --it;
+    Node* m = (Node*)alloca(_s);
+    for (const uint64_t end = offset + size; it != segments.end() && it->offset < end; ++it) {
+      const uint64_t lo = std::max(offset, it->offset), hi = std::min(end, it->offset + it->size);
+      if (lo >= hi)
+        continue;
+      if (!it->renumber) {
+        memcpy(buffer + (lo - offset), it->data + (lo - it->offset), hi - lo);
+        continue;
+      }
+      for (uint64_t k = (lo - it->offset) / _s; it->offset + k * _s < hi; k++) {
+        const uint64_t node = it->offset + k * _s;
+        memcpy(m, it->data + k * _s, _s);
+        for (int side = 0; side < 2; side++)
+          if (m->children[side] >= _n_items)
+            m->children[side] = renumbered[m->children[side] - _n_items];
+        const uint64_t from = std::max(node, lo), to = std::min(node + _s, hi);
+        memcpy(buffer + (from - offset), (const char*)m + (from - node), to - from);
       }
+    }
+  }
 
-      if (fclose(f) == EOF) {
-        showUpdate("Unable to close: %s\n", strerror(errno));
-        if (error) *error = strerror(errno);
+  static bool _pwrite_all(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+      // No pwrite, there is a single writer (see _write_index)
+      if (_lseeki64(fd, offset, SEEK_SET) == -1)
+        return false;
+      const int k = write(fd, data, (unsigned int)std::min(size, (size_t)1 << 30));
+#else
+      const ssize_t k = pwrite(fd, data, size, offset);
+#endif
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0) {
+        if (k == 0)
+          errno = EIO;
         return false;
       }
-
-      unload();
-      return load(filename, prefault, error);
+      data += k;
+      size -= k;
+      offset += k;
     }
+    return true;
   }
 
-  void reinitialize() {
-    _fd = 0;
-    _nodes = NULL;
-    _loaded = false;
-    _n_items = 0;
-    _n_nodes = 0;
-    _nodes_size = 0;
-    _on_disk = false;
-    _roots.clear();
+  void _write_chunks(int fd, const vector<Segment>* segments, const vector<S>* renumbered, uint64_t size,
+                     const SaveOptions* options, size_t chunk, size_t first, size_t step, int* result) const {
+    // Writes chunks first, first + step, ... of the file: straight from the
+    // nodes if the chunk is in one segment (and aligned, for O_DIRECT), or
+    // gathered into a buffer. result gets errno, or 0.
+    char* buffer = NULL; // Of one chunk, mapped on first use: page aligned, as O_DIRECT needs
+    const size_t block = 4096;
+    *result = 0;
+    for (uint64_t offset = first * chunk; offset < size && !*result; offset += step * chunk) {
+      const size_t len = (size_t)std::min((uint64_t)chunk, size - offset);
+      const size_t written = options->direct ? (size_t)_align_up(len, block) : len; // Cut off by the final ftruncate
+      typename vector<Segment>::const_iterator it = std::upper_bound(segments->begin(), segments->end(), offset, _segment_before);
+      const char* data = NULL;
+      if (it != segments->begin()) {
+        --it;
+        if (!it->renumber && offset + len <= it->offset + it->size)
+          data = it->data + (offset - it->offset);
+        if (data && options->direct && ((uintptr_t)data % block || written != len))
+          data = NULL;
+      }
+      if (!data && !buffer) {
+        void* p = mmap(NULL, chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          *result = ENOMEM;
+          break;
+        }
+        buffer = (char*)p;
+      }
+      if (!data) {
+        memset(buffer, 0, written);
+        _gather(*segments, *renumbered, offset, len, buffer);
+        data = buffer;
+      }
+      if (!_pwrite_all(fd, data, written, offset)) {
+        *result = errno;
+        break;
+      }
+#ifdef SYNC_FILE_RANGE_WRITE
+      if (options->sync == ANNOY_SYNC_CHUNK)
+        sync_file_range(fd, offset, written, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+    }
+    if (buffer)
+      munmap(buffer, chunk);
   }
 
-  void unload() {
-    if (_on_disk && _fd) {
-      close(_fd);
-      munmap(_nodes, _s * _nodes_size);
-    } else {
-      if (_fd) {
-        // we have mmapped data
-        close(_fd);
-        munmap(_nodes, _n_nodes * _s);
-      } else if (_nodes) {
-        // We have heap allocated data
-        free(_nodes);
+  bool _write_index(int fd, const vector<Segment>& segments, const vector<S>& renumbered, uint64_t size,
+                    const SaveOptions& options) const {
+    // Writes the segments with options.n_threads writers taking turns at
+    // the chunks, so that they move through the file together. False with
+    // errno set if that fails.
+    const size_t chunk = std::max((size_t)1, options.chunk_size / 4096) * 4096;
+    size_t n_threads = 1;
+#if defined(ANNOY_MULTITHREADED_BUILD) && !defined(_MSC_VER) && !defined(__MINGW32__)
+    n_threads = options.n_threads > 0 ? options.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    n_threads = std::max((size_t)1, std::min(n_threads, (size_t)((size + chunk - 1) / chunk)));
+#endif
+    vector<int> results(n_threads, 0);
+#if defined(ANNOY_MULTITHREADED_BUILD)
+    vector<std::thread> pool;
+    for (size_t i = 1; i < n_threads; i++)
+      pool.push_back(std::thread(&AnnoyIndex::_write_chunks, this, fd, &segments, &renumbered, size,
+                                 &options, chunk, i, n_threads, &results[i]));
+#endif
+    _write_chunks(fd, &segments, &renumbered, size, &options, chunk, 0, n_threads, &results[0]);
+#if defined(ANNOY_MULTITHREADED_BUILD)
+    for (size_t i = 0; i < pool.size(); i++)
+      pool[i].join();
+#endif
+    for (size_t i = 0; i < n_threads; i++) {
+      if (results[i]) {
+        errno = results[i];
+        return false;
       }
     }
-    reinitialize();
-    if (_verbose) showUpdate("unloaded\n");
+    return true;
   }
 
-  bool load(const char* filename, bool prefault=false, char** error=NULL) {
-    _fd = open(filename, O_RDONLY, (int)0400);
-    if (_fd == -1) {
-      showUpdate("Error: file descriptor is -1\n");
-      if (error) *error = strerror(errno);
-      _fd = 0;
-      return false;
+  bool _map_index(size_t size, const LoadOptions& options) {
+    // Sets _file_map and _mapped_size to the file at _fd, or a copy of it,
+    // as the options say. False with errno set, and nothing left mapped, if
+    // that fails.
+    void* data = MAP_FAILED;
+    _mapped_size = size;
+    if (options.memory == ANNOY_LOAD_ANONYMOUS) {
+      data = _arena.grow(size);
+      if (!data) {
+        const int e = errno;
+        _arena.release(); // It may have reserved the address space
+        errno = e;
+        return false;
+      }
+    } else if (options.memory == ANNOY_LOAD_HUGETLB) {
+#ifdef MAP_HUGETLB
+      _mapped_size = (size + NodeArena::chunk_size - 1) & ~(NodeArena::chunk_size - 1);
+      data = mmap(0, _mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#else
+      errno = ENOTSUP;
+#endif
+      if (data == MAP_FAILED)
+        return false;
+    } else {
+      int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+      if (options.populate)
+        flags |= MAP_POPULATE;
+#endif
+      data = NodeArena::map_aligned(_fd, size, flags);
+      if (data == MAP_FAILED)
+        return false;
     }
-    off_t size = lseek(_fd, 0, SEEK_END);
-    if (size == -1) {
-      showUpdate("lseek returned -1\n");
-      if (error) *error = strerror(errno);
-      return false;
-    } else if (size == 0) {
-      showUpdate("Size of file is zero\n");
-      if (error) *error = (char *)"Size of file is zero";
-      return false;
-    } else if (size % _s) {
-      // Something is fishy with this index!
-      showUpdate("Error: index size %zu is not a multiple of vector size %zu\n", (size_t)size, _s);
-      if (error) *error = (char *)"Index size is not a multiple of vector size";
+    _file_map = data;
+    _load_memory = options.memory;
+
+    if (options.memory != ANNOY_LOAD_MAPPED) {
+      // Read the file into the copy in large sequential chunks
+      for (size_t done = 0; done < size; ) {
+        ssize_t k = pread(_fd, (char*)data + done, std::min(size - done, (size_t)64 << 20), done);
+        if (k <= 0) {
+          if (k == 0)
+            errno = EIO;
+          _unmap_index();
+          return false;
+        }
+        done += k;
+      }
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+      mprotect(data, size, PROT_READ); // Not on Windows, where the arena is a heap block
+#endif
+    } else {
+#ifdef MADV_HUGEPAGE
+      if (options.hugepage)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_RANDOM
+      if (options.random)
+        madvise(data, size, MADV_RANDOM);
+#endif
+#ifdef MADV_WILLNEED
+      if (options.willneed)
+        madvise(data, size, MADV_WILLNEED);
+#endif
+      if (options.prefault) {
+        // One read per page brings the whole file in
+        volatile char touch = 0;
+        for (size_t i = 0; i < size; i += 4096)
+          touch += ((const char*)data)[i];
+        (void)touch;
+      }
+    }
+    if (options.lock && mlock(data, size) != 0) {
+      _unmap_index();
       return false;
     }
+    return true;
+  }
 
-    int flags = MAP_SHARED;
-
-    if (prefault) {
-      int touch = 0;
-      printf("pre-touch in advance\n");
-      _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
-      for (int i = 0; i < size; i += 1024)
-        touch += (*(int *) ((uintptr_t) _nodes + i)) & 0xffffffff;
-      printf("touch magic :%d, sleep 10 sec to check\n", touch);
-      for (int i = 0; i < size; i += 1024)
-        touch += (*(int *) ((uintptr_t) _nodes + i)) & 0xffffffff;
-      // sleep(10);
-      munmap(_nodes, size);
-    }
+  void _unmap_index() {
+    // Undoes _map_index(), keeping errno
+    const int e = errno;
+    if (_load_memory == ANNOY_LOAD_ANONYMOUS)
+      _arena.release();
+    else
+      munmap(_file_map, _mapped_size);
+    _file_map = NULL;
+    _mapped_size = 0;
+    _load_memory = ANNOY_LOAD_MAPPED;
+    errno = e;
+  }
 
+  void _abort_load(bool mapped) {
+    // Closes the file of a load() that failed, and unmaps it if it was
+    // mapped, so that the index is empty again
+    if (mapped)
+      _unmap_index();
+    close(_fd);
+    reinitialize();
+  }
 
-    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
-    _n_nodes = (S)(size / _s);
+#ifdef ANNOY_MULTITHREADED_BUILD
+  void _warm(WarmupState* state, WarmupOptions options) {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    int n_threads = options.n_threads;
+    if (n_threads <= 0)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    if (options.strategy == ANNOY_WARM_TOP_DOWN) {
+      _warm_trees(n_threads);
+      state->stats.tree_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    // A copy was read in full by load(), there is nothing to read ahead
+    const bool readahead = options.strategy == ANNOY_WARM_READAHEAD && _load_memory == ANNOY_LOAD_MAPPED;
+    const size_t chunk = std::max((size_t)1, options.chunk_size / 4096) * 4096; // Whole pages
+    vector<std::thread> pool;
+    for (int i = 1; i < n_threads; i++)
+      pool.push_back(std::thread(&AnnoyIndex::_warm_chunks, this, state, chunk, readahead));
+    _warm_chunks(state, chunk, readahead);
+    for (size_t i = 0; i < pool.size(); i++)
+      pool[i].join();
+    state->stats.bytes = state->warmed;
+    state->stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (options.strategy != ANNOY_WARM_TOP_DOWN)
+      state->stats.tree_seconds = state->stats.seconds;
+  }
 
-    // Find the roots by scanning the end of the file and taking the nodes with most descendants
-    _roots.clear();
-    S m = -1;
-    for (S i = _n_nodes - 1; i >= 0; i--) {
-      S k = _get(i)->n_descendants;
-      if (m == -1 || k == m) {
-        _roots.push_back(i);
-        m = k;
-      } else {
+  void _warm_chunks(WarmupState* state, size_t chunk, bool readahead) const {
+    // Takes the next chunk until there are none left, so that the threads
+    // move through the file together from the front to the back
+    const char* base = (const char*)_file_map;
+    volatile char touch = 0;
+    for (;;) {
+      const size_t offset = state->next.fetch_add(chunk);
+      if (offset >= _mapped_size)
         break;
+      const size_t len = std::min(chunk, _mapped_size - offset);
+      if (readahead) {
+        // One large read instead of one per readahead window of the faults
+#ifdef __linux__
+        ::readahead(_fd, offset, len);
+#elif defined(MADV_WILLNEED)
+        madvise((char*)base + offset, len, MADV_WILLNEED);
+#endif
       }
+      for (size_t i = 0; i < len; i += 4096)
+        touch += base[offset + i];
+      state->warmed += len;
     }
-    // hacky fix: since the last root precedes the copy of all roots, delete it
-    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
-      _roots.pop_back();
-    _loaded = true;
-    _built = true;
-    _n_items = m;
-    if (_verbose) showUpdate("found %lu roots with degree %d\n", _roots.size(), m);
-    return true;
+    (void)touch;
   }
 
-  T get_distance(S i, S j) const {
-    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  void _warm_trees(int n_threads) const {
+    // Reads the nodes of all trees a level at a time in file order, so that
+    // the roots and the upper splits every query goes through come in first
+    vector<S> level(_roots);
+    vector<vector<S> > next(n_threads);
+    while (!level.empty()) {
+      std::sort(level.begin(), level.end());
+      const size_t threads = std::max((size_t)1, std::min((size_t)n_threads, level.size() / 256)); // Not worth a thread otherwise
+      vector<std::thread> pool;
+      for (size_t i = 1; i < threads; i++)
+        pool.push_back(std::thread(&AnnoyIndex::_warm_level, this, &level,
+                                   level.size() * i / threads, level.size() * (i + 1) / threads, &next[i]));
+      _warm_level(&level, 0, level.size() / threads, &next[0]);
+      for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+      level.clear();
+      for (size_t i = 0; i < threads; i++) {
+        level.insert(level.end(), next[i].begin(), next[i].end());
+        next[i].clear();
+      }
+    }
   }
 
-  void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    // TODO: handle OOB
-    const Node* m = _get(item);
-    _get_all_nns(m->v, n, search_k, result, distances);
+  void _warm_level(const vector<S>* level, size_t begin, size_t end, vector<S>* children) const {
+    // The children of the splits, leaves and items are not followed
+    for (size_t i = begin; i < end; i++) {
+      const Node* nd = _get((*level)[i]);
+      if (nd->n_descendants <= _max_leaf())
+        continue;
+      for (int side = 0; side < 2; side++)
+        if (nd->children[side] >= _n_items)
+          children->push_back(nd->children[side]);
+    }
   }
+#endif
 
-  void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    _get_all_nns(w, n, search_k, result, distances);
+  const char* _check_header(const IndexHeader& header, off_t size) const {
+    // Why the index can't be loaded into this one, or NULL if it can
+    if (header.version > ANNOY_INDEX_VERSION)
+      return "Index was written by a newer version";
+    if (header.f != (uint32_t)_f)
+      return "Index has a different number of dimensions";
+    if (strncmp(header.metric, D::name(), sizeof(header.metric)) != 0)
+      return "Index was built with a different metric";
+    if (strncmp(header.storage, VectorStorage<V>::name(), sizeof(header.storage)) != 0
+        || header.s_size != sizeof(S) || header.t_size != sizeof(T)
+        || header.node_size != _s || header.K != (uint32_t)_K)
+      return "Index was built with different types";
+    if (header.file_size != (uint64_t)size
+        || header.n_items > header.n_nodes || header.node_offset > header.n_items
+        || header.n_nodes > (uint64_t)numeric_limits<S>::max()
+        || header.n_leaves > header.n_nodes - header.n_items
+        || header.nodes_offset + (header.n_items - header.node_offset) * _s > (uint64_t)size
+        || header.leaves_offset + header.n_leaves * _s > (uint64_t)size
+        || header.splits_offset + (header.n_nodes - header.n_items - header.n_leaves) * _s > (uint64_t)size
+        || header.roots_offset + header.n_roots * sizeof(S) > (uint64_t)size
+        || (header.ids_offset && header.ids_offset + 2 * header.n_items * sizeof(S) > (uint64_t)size)
+        || header.leaf_size > 4096
+        || (header.pq_m && header.centroids_offset > (uint64_t)size))
+      return "Index is truncated or corrupt";
+    return NULL;
   }
 
-  S get_n_items() const {
-    return _n_items;
+  bool _read_footer(off_t size, typename ProductQuantizer<S, T>::Footer* footer) const {
+    // True if the file at _fd is a quantized index from before the header
+    // for this index
+    if ((size_t)size < sizeof(*footer))
+      return false;
+    if (pread(_fd, footer, sizeof(*footer), size - sizeof(*footer)) != (ssize_t)sizeof(*footer))
+      return false;
+    return memcmp(footer->magic, "ANNOYPQ1", 8) == 0
+      && footer->f == (uint32_t)_f && footer->t_size == sizeof(T)
+      && footer->centroids_offset + ((size_t)1 << footer->nbits) * _f * sizeof(T) + sizeof(*footer) == (uint64_t)size;
   }
 
-  S get_n_trees() const {
-    return _roots.size();
+  struct TreeNodes {
+    // The nodes of one tree while it is built, numbered from _n_items on as
+    // if the tree were the only one. _flush_tree() moves them into _nodes;
+    // buf holds the ones from flushed on.
+    vector<char> buf;
+    S n;
+    S flushed;
+    S root;
+    TreeNodes() : n(0), flushed(0), root(0) {}
+  };
+
+  struct BuildState {
+    // Shared by the threads of build(). Tree t is built by whichever thread
+    // draws t, and n_trees is lowered once enough trees are done if q is -1.
+    vector<S> indices;
+    vector<Node*> items; // Their nodes, which stay put while trees are built
+    vector<TreeNodes> trees;
+    int q;
+    size_t next;
+    size_t n_trees;
+    size_t n_counted; // Trees 0 .. n_counted - 1 are done
+    S n_counted_nodes;
+    size_t n_flushed; // Trees 0 .. n_flushed - 1 are in _nodes
+#ifdef ANNOY_MULTITHREADED_BUILD
+    std::mutex lock;
+#endif
+  };
+
+  void _build_trees(BuildState* state) {
+    TreeScratch scratch;
+    while (true) {
+      size_t t;
+      {
+#ifdef ANNOY_MULTITHREADED_BUILD
+        std::lock_guard<std::mutex> lock(state->lock);
+#endif
+        t = state->next++;
+        if (t >= state->n_trees)
+          return;
+      }
+      if (_verbose) showUpdate("pass %zd...\n", t);
+      TreeNodes tree;
+      Random random = _tree_random(t);
+      vector<S>& indices = scratch.indices;
+      vector<Node*>& items = scratch.items;
+      indices = state->indices;
+      items = state->items;
+      tree.root = _make_tree(indices.empty() ? NULL : &indices[0], items.empty() ? NULL : &items[0], indices.size(),
+                             true, random, tree, scratch);
+      {
+#ifdef ANNOY_MULTITHREADED_BUILD
+        std::lock_guard<std::mutex> lock(state->lock);
+#endif
+        if (state->trees.size() <= t)
+          state->trees.resize(t + 1);
+        state->trees[t].buf.swap(tree.buf);
+        state->trees[t].n = tree.n;
+        state->trees[t].flushed = tree.flushed;
+        state->trees[t].root = tree.root;
+        // Without q, stop at the same tree as building them one by one would
+        while (state->n_counted < state->trees.size() && state->n_counted < state->n_trees
+               && !state->trees[state->n_counted].buf.empty()) {
+          state->n_counted_nodes += state->trees[state->n_counted++].n;
+          if (state->q == -1 && state->n_counted_nodes >= _n_items)
+            state->n_trees = state->n_counted;
+        }
+        while (state->n_flushed < state->n_counted && _can_flush_built_tree(state->trees[state->n_flushed])
+               && _flush_built_tree(state->trees[state->n_flushed]))
+          state->n_flushed++;
+      }
+    }
   }
 
-  void verbose(bool v) {
-    _verbose = v;
+  Random _tree_random(size_t t) const {
+    // Seeds the generator of tree t by mixing the index seed with t
+    // (splitmix64), so that trees don't depend on each other
+    uint64_t z = ((uint64_t)_seed << 32) + t + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    Random random;
+    random.set_seed((uint32_t)z | 1); // Must not be 0
+    return random;
   }
 
-  void get_item(S item, T* v) const {
-    // TODO: handle OOB
-    Node* m = _get(item);
-    memcpy(v, m->v, (_f) * sizeof(T));
+  bool _flush_built_tree(TreeNodes& tree) {
+    // Appends a tree of _build_in_memory() after the nodes and frees its
+    // buffer. Split nodes point to their children by id, which shifts along.
+    if (!_flush_tree(tree, _n_nodes))
+      return false;
+    _roots.push_back(tree.root + (_n_nodes - _n_items));
+    _n_nodes += tree.n;
+    vector<char>().swap(tree.buf);
+    _write_back(_n_nodes, true, false);
+    return true;
   }
 
-  void set_seed(int seed) {
-    _random.set_seed(seed);
+  bool _can_flush_built_tree(const TreeNodes& tree) const {
+    // While other threads build trees from the items, a tree can only be
+    // appended if the nodes don't have to move for it
+    const size_t n = (size_t)_n_nodes + tree.n;
+    return n <= (size_t)numeric_limits<S>::max() && _arena.grows_in_place(_header_bytes + _s * n);
   }
 
-protected:
-  void _allocate_size(S n) {
-    if (n > _nodes_size) {
-      const double reallocation_factor = 1.3;
-      S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
-      void *old = _nodes;
-      
-      if (_on_disk) {
-        int rc = ftruncate(_fd, _s * new_nodes_size);
-        if (_verbose && rc) showUpdate("File truncation error\n");
-        _nodes = remap_memory(_nodes, _fd, _s * _nodes_size, _s * new_nodes_size);
-      } else {
-        _nodes = realloc(_nodes, _s * new_nodes_size);
-        memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+  bool _flush_tree(TreeNodes& tree, S base) {
+    // Moves the buffered nodes of a tree that starts at node base to their
+    // place in _nodes. Split nodes point to their children by id, which
+    // shifts along; item ids don't.
+    const S offset = base - _n_items;
+    if (!_allocate_size(base + tree.n))
+      return false;
+    memcpy(_get(base + tree.flushed), &tree.buf[0], (size_t)(tree.n - tree.flushed) * _s);
+    for (S i = tree.flushed; i < tree.n; i += _run(base + i)) {
+      Node* m = _get(base + i);
+      if (m->n_descendants > _max_leaf()) {
+        for (int side = 0; side < 2; side++)
+          if (m->children[side] >= _n_items)
+            m->children[side] += offset;
       }
-      
-      _nodes_size = new_nodes_size;
-      if (_verbose) showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
     }
+    tree.flushed = tree.n;
+    tree.buf.clear(); // Keeps its capacity for the next nodes
+    return true;
   }
 
-  inline Node* _get(const S i) const {
-    return get_node_ptr<S, Node>(_nodes, _s, i);
+  S _new_node(TreeNodes& tree) {
+    const size_t used = (size_t)(tree.n - tree.flushed) * _s;
+    if (used + _s > tree.buf.size())
+      tree.buf.resize(std::max(used + _s, tree.buf.size() * 2));
+    return _n_items + tree.n++;
   }
 
-  S _make_tree(const vector<S >& indices, bool is_root) {
+  Node* _tree_node(TreeNodes& tree, S i) {
+    return (Node*)&tree.buf[(size_t)(i - _n_items - tree.flushed) * _s];
+  }
+
+  struct TreeScratch {
+    // Working memory of _make_tree, shared by all levels of the recursion and
+    // by all the trees one thread builds, so it is only allocated once
+    vector<S> indices; // The items of the tree, partitioned in place
+    vector<Node*> items; // Their nodes, partitioned along
+    vector<Node*> nodes; // The nodes of a span, for the split
+    vector<S> right; // Side 1 while a span is partitioned
+    vector<Node*> right_items;
+    vector<char> bucket; // The nodes of a subtree of an out-of-core build
+  };
+
+  S _make_tree(S* indices, Node** items, size_t n, bool is_root, Random& random, TreeNodes& tree, TreeScratch& scratch) {
+    // Builds the subtree of indices[0 .. n-1], whose nodes are items[0 .. n-1],
+    // and reorders both: each split partitions the spans in place, side 0
+    // first, so the recursion doesn't allocate. The partition is stable,
+    // which keeps the items of a span in memory order.
     // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
+    // (Or <= _leaf_size items with fat leaves, which then are a run of nodes, see set_leaf_size.)
     // There's some regrettable complications caused by the problem that root nodes have to be "special":
     // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
     // 2. Root nodes with only 1 child need to be a "dummy" parent
     // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
-    if (indices.size() == 1 && !is_root)
+    if (n == 1 && !is_root)
       return indices[0];
 
-    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
-      _allocate_size(_n_nodes + 1);
-      S item = _n_nodes++;
-      Node* m = _get(item);
-      m->n_descendants = is_root ? _n_items : (S)indices.size();
+    if (n <= (size_t)_max_leaf() && (!is_root || (size_t)_n_items <= (size_t)_max_leaf() || n == 1)) {
+      S item = _new_node(tree);
+      if (_leaf_size) {
+        // The leaf counts its items, the copies behind it carry their ids
+        for (size_t k = 0; k < n; k++)
+          _new_node(tree);
+        Node* m = _tree_node(tree, item);
+        memset(m, 0, _s);
+        m->n_descendants = (S)n;
+        for (size_t k = 0; k < n; k++) {
+          memcpy(_fat_item(m, (S)k), items[k], _s);
+          _fat_item(m, (S)k)->n_descendants = indices[k];
+        }
+        return item;
+      }
+      Node* m = _tree_node(tree, item);
+      m->n_descendants = is_root ? _n_items : (S)n;
 
       // Using std::copy instead of a loop seems to resolve issues #3 and #13,
       // probably because gcc 4.8 goes overboard with optimizations.
       // Using memcpy instead of std::copy for MSVC compatibility. #235
       // Only copy when necessary to avoid crash in MSVC 9. #293
-      if (!indices.empty())
-        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+      if (n > 0)
+        memcpy(m->children, indices, n * sizeof(S));
       return item;
     }
 
-    vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n)
-        children.push_back(n);
-    }
+    vector<Node*>& nodes = scratch.nodes;
+    nodes.assign(items, items + n); // Keeps its capacity, so only the root allocates
 
-    vector<S> children_indices[2];
-    Node* m = (Node*)alloca(_s);
-    D::create_split(children, _f, _s, _random, m);
-
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n) {
-        bool side = D::side(m, n->v, _f, _random);
-        children_indices[side].push_back(j);
-      } else {
-        showUpdate("No node for index %d?\n", j);
-      }
-    }
+    FullNode* m = (FullNode*)alloca(_fs);
+    Split::template create_split<D>(nodes, _f, _fs, random, _split_options, m);
+
+    size_t n0 = _partition(indices, items, n, m, random, scratch);
 
     // If we didn't find a hyperplane, just randomize sides as a last option
-    while (children_indices[0].size() == 0 || children_indices[1].size() == 0) {
+    while (n0 == 0 || n0 == n) {
       if (_verbose)
-        showUpdate("\tNo hyperplane found (left has %ld children, right has %ld children)\n",
-          children_indices[0].size(), children_indices[1].size());
-      if (_verbose && indices.size() > 100000)
-        showUpdate("Failed splitting %lu items\n", indices.size());
-
-      children_indices[0].clear();
-      children_indices[1].clear();
+        showUpdate("\tNo hyperplane found (left has %zu children, right has %zu children)\n",
+          n0, n - n0);
+      if (_verbose && n > 100000)
+        showUpdate("Failed splitting %zu items\n", n);
 
       // Set the vector to 0.0
       for (int z = 0; z < _f; z++)
         m->v[z] = 0.0;
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        // Just randomize...
-        children_indices[_random.flip()].push_back(j);
-      }
+      // Just randomize...
+      n0 = _partition(indices, items, n, NULL, random, scratch);
     }
 
-    int flip = (children_indices[0].size() > children_indices[1].size());
+    S* children_indices[2] = {indices, indices + n0};
+    Node** children_items[2] = {items, items + n0};
+    size_t children_size[2] = {n0, n - n0};
+    int flip = (children_size[0] > children_size[1]);
 
-    m->n_descendants = is_root ? _n_items : (S)indices.size();
+    m->n_descendants = is_root ? _n_items : (S)n;
     for (int side = 0; side < 2; side++) {
       // run _make_tree for the smallest child first (for cache locality)
-      m->children[side^flip] = _make_tree(children_indices[side^flip], false);
+      m->children[side^flip] = _make_tree(children_indices[side^flip], children_items[side^flip], children_size[side^flip],
+                                          false, random, tree, scratch);
+    }
+
+    S item = _new_node(tree);
+    _store(_tree_node(tree, item), m);
+
+    return item;
+  }
+
+  size_t _partition(S* indices, Node** items, size_t n, const FullNode* m, Random& random, TreeScratch& scratch) {
+    // Moves the items on side 0 of m (random sides if m is NULL) to the
+    // front, along with their nodes, keeping their order, and returns how
+    // many there are.
+    vector<S>& right = scratch.right;
+    vector<Node*>& right_items = scratch.right_items;
+    right.resize(n);
+    right_items.resize(n);
+    size_t n0 = 0, n1 = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (m ? D::side(m, items[i]->data(), _f, random) : random.flip()) {
+        right[n1] = indices[i];
+        right_items[n1++] = items[i];
+      } else {
+        indices[n0] = indices[i];
+        items[n0++] = items[i];
+      }
+    }
+    if (n1 > 0) {
+      memcpy(indices + n0, &right[0], n1 * sizeof(S));
+      memcpy(items + n0, &right_items[0], n1 * sizeof(Node*));
+    }
+    return n0;
+  }
+
+  struct Spill {
+    // The items of a subtree of an out-of-core build: n records, which are
+    // an id followed by a node in a mapped temporary file, or the item nodes
+    // themselves at the root
+    const char* data;
+    size_t n;
+    size_t record;
+    bool ids;
+    size_t mapped; // Bytes to unmap, 0 for the items
+  };
+
+  struct SpillWriter {
+    int fd;
+    vector<char> buf;
+    size_t used;
+    size_t n;
+    SpillWriter() : fd(-1), used(0), n(0) {}
+  };
+
+  const Node* _spill_node(const Spill& spill, size_t i) const {
+    return (const Node*)(spill.data + i * spill.record + (spill.ids ? sizeof(S) : 0));
+  }
+
+  S _spill_id(const Spill& spill, size_t i) const {
+    if (!spill.ids)
+      return (S)i;
+    S id;
+    memcpy(&id, spill.data + i * spill.record, sizeof(S));
+    return id;
+  }
+
+  void _unmap_spill(Spill& spill) {
+    if (spill.mapped)
+      munmap((void*)spill.data, spill.mapped);
+    spill.mapped = 0;
+  }
+
+  int _open_spill() {
+    // A temporary file, unlinked right away so that it goes with its mapping
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    return -1;
+#else
+    std::string path = _spill_prefix + "XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd != -1)
+      unlink(path.c_str());
+    return fd;
+#endif
+  }
+
+  bool _spill_flush(SpillWriter& w) {
+    for (size_t done = 0; done < w.used; ) {
+      ssize_t k = write(w.fd, &w.buf[done], w.used - done);
+      if (k <= 0)
+        return false;
+      done += k;
+    }
+    w.used = 0;
+    return true;
+  }
+
+  bool _partition_spill(const Spill& spill, const FullNode* m, Random& random, SpillWriter* out) {
+    // Streams the items of spill to out[side], in order, with random sides
+    // if m is NULL
+    const size_t record = sizeof(S) + _s;
+    for (int side = 0; side < 2; side++) {
+      out[side].used = 0;
+      out[side].n = 0;
+      out[side].buf.resize(std::max(record, (size_t)4 << 20));
+      if (ftruncate(out[side].fd, 0) != 0 || lseek(out[side].fd, 0, SEEK_SET) != 0)
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise((void*)spill.data, spill.n * spill.record, MADV_SEQUENTIAL);
+#endif
+    for (size_t i = 0; i < spill.n; i++) {
+      const Node* nd = _spill_node(spill, i);
+      if (!spill.ids && nd->n_descendants < 1)
+        continue;
+      SpillWriter& w = out[m ? D::side(m, nd->data(), _f, random) : random.flip()];
+      if (w.used + record > w.buf.size() && !_spill_flush(w))
+        return false;
+      S id = _spill_id(spill, i);
+      memcpy(&w.buf[w.used], &id, sizeof(S));
+      memcpy(&w.buf[w.used + sizeof(S)], nd, _s);
+      w.used += record;
+      w.n++;
+    }
+    return _spill_flush(out[0]) && _spill_flush(out[1]);
+  }
+
+  S _make_tree_external(Spill& spill, size_t n, bool is_root, Random& random, TreeNodes& tree, TreeScratch& scratch,
+                        S base, const char** error) {
+    // Builds the subtree of the n items of spill, which it unmaps, for a tree
+    // that starts at node base. Sets error if it fails.
+    if (!is_root && (n * (_s + 2 * sizeof(S) + 3 * sizeof(Node*)) <= _build_budget || n <= (size_t)_max_leaf())) {
+      // Fits: copy it, build its subtree like build() would and write it out
+      vector<char>& bucket = scratch.bucket;
+      vector<S>& indices = scratch.indices;
+      vector<Node*>& items = scratch.items;
+      bucket.resize(n * _s);
+      indices.resize(n);
+      items.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        memcpy(&bucket[i * _s], _spill_node(spill, i), _s);
+        indices[i] = _spill_id(spill, i);
+        items[i] = (Node*)&bucket[i * _s];
+      }
+      _unmap_spill(spill);
+      S item = _make_tree(&indices[0], &items[0], n, false, random, tree, scratch);
+      if (!_flush_tree(tree, base))
+        *error = "Unable to allocate memory for the nodes";
+      _write_back(base + tree.n, true, false);
+      return item;
+    }
+
+    // Split on a sample, then stream the items to one file per side
+    vector<Node*>& nodes = scratch.nodes;
+    nodes.clear();
+    for (size_t i = 0; i < 1024; i++) {
+      const Node* nd = _spill_node(spill, random.index(spill.n));
+      if (nd->n_descendants >= 1)
+        nodes.push_back((Node*)nd);
+    }
+    FullNode* m = (FullNode*)alloca(_fs);
+    memset(m, 0, _fs); // The plane of random sides, if the sample can't be split
+    D::zero_value(m);
+    const bool sampled = nodes.size() >= 2; // Gaps aside
+    if (sampled)
+      Split::template create_split<D>(nodes, _f, _fs, random, _split_options, m);
+
+    SpillWriter out[2];
+    out[0].fd = _open_spill();
+    out[1].fd = _open_spill();
+    // A sample of (almost) only gaps has no plane to split on, so take random sides
+    bool ok = out[0].fd != -1 && out[1].fd != -1 && _partition_spill(spill, sampled ? m : NULL, random, out);
+    // If we didn't find a hyperplane, just randomize sides as a last option
+    while (ok && (out[0].n == 0 || out[0].n == n)) {
+      if (_verbose)
+        showUpdate("\tNo hyperplane found (left has %zu children, right has %zu children)\n", out[0].n, n - out[0].n);
+      for (int z = 0; z < _f; z++)
+        m->v[z] = 0.0;
+      ok = _partition_spill(spill, NULL, random, out);
     }
+    _unmap_spill(spill);
 
-    _allocate_size(_n_nodes + 1);
-    S item = _n_nodes++;
-    memcpy(_get(item), m, _s);
+    Spill children[2];
+    for (int side = 0; side < 2; side++) {
+      children[side].n = out[side].n;
+      children[side].record = sizeof(S) + _s;
+      children[side].ids = true;
+      children[side].mapped = 0;
+      if (ok) {
+        void* p = mmap(0, out[side].n * children[side].record, PROT_READ, MAP_SHARED, out[side].fd, 0);
+        if (p == MAP_FAILED) {
+          ok = false;
+        } else {
+          children[side].data = (const char*)p;
+          children[side].mapped = out[side].n * children[side].record;
+        }
+      }
+      if (out[side].fd != -1)
+        close(out[side].fd);
+    }
+    if (!ok) {
+      *error = strerror(errno);
+      _unmap_spill(children[0]);
+      _unmap_spill(children[1]);
+      return 0;
+    }
+
+    int flip = (children[0].n > children[1].n);
+    m->n_descendants = is_root ? _n_items : (S)n;
+    for (int side = 0; side < 2 && !*error; side++) {
+      // run _make_tree_external for the smallest child first, as _make_tree does
+      Spill& child = children[side^flip];
+      m->children[side^flip] = _make_tree_external(child, child.n, false, random, tree, scratch, base, error);
+    }
+    _unmap_spill(children[0]);
+    _unmap_spill(children[1]);
 
+    S item = _new_node(tree);
+    _store(_tree_node(tree, item), m);
     return item;
   }
 
   void _get_all_nns(const T* v, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    Node* v_node = (Node *)alloca(_s);
-    D::template zero_value<Node>(v_node);
+    FullNode* v_node = (FullNode *)alloca(_fs);
+    D::template zero_value<FullNode>(v_node);
     memcpy(v_node->v, v, sizeof(T) * _f);
     D::init_node(v_node, _f);
 
@@ -1266,19 +6087,30 @@ protected:
     }
 
     std::vector<S> nns;
-    while (nns.size() < search_k && !q.empty()) {
+    vector<const Node*> fat; // Copies of the items of the fat leaves
+    while (nns.size() + fat.size() < search_k && !q.empty()) {
       const pair<T, S>& top = q.top();
       T d = top.first;
       S i = top.second;
-      Node* nd = _get(i);
       q.pop();
+      if (_pq.ready() && i < _n_items) {
+        // The item nodes may not be there at all
+        nns.push_back(i);
+        continue;
+      }
+      Node* nd = _get(i);
       if (nd->n_descendants == 1 && i < _n_items) {
         nns.push_back(i);
-      } else if (nd->n_descendants <= _K) {
-        const S* dst = nd->children;
-        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+      } else if (nd->n_descendants <= _max_leaf()) {
+        if (_leaf_size) {
+          for (S k = 0; k < nd->n_descendants; k++)
+            fat.push_back(_fat_item(nd, k));
+        } else {
+          const S* dst = nd->children;
+          nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+        }
       } else {
-        T margin = D::margin(nd, v, _f);
+        T margin = D::margin(nd, v_node->data(), _f);
         q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
         q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
       }
@@ -1287,25 +6119,89 @@ protected:
     // Get distances for all items
     // To avoid calculating distance multiple times for any items, sort by id
     std::sort(nns.begin(), nns.end());
-    vector<pair<T, S> > nns_dist;
+    vector<const Node*> candidates;
+    vector<S> candidate_ids;
     S last = -1;
     for (size_t i = 0; i < nns.size(); i++) {
       S j = nns[i];
       if (j == last)
         continue;
       last = j;
-      if (_get(j)->n_descendants == 1)  // This is only to guard a really obscure case, #284
-        nns_dist.push_back(make_pair(D::distance(v_node, _get(j), _f), j));
+      if (_pq.ready()) {
+        candidate_ids.push_back(j);
+      } else if (_get(j)->n_descendants == 1) {  // This is only to guard a really obscure case, #284
+        candidates.push_back(_get(j));
+        candidate_ids.push_back(j);
+      }
+    }
+
+    // Score all candidates in one batched call
+    vector<T> candidate_dists(candidate_ids.size());
+    if (_pq.ready() && !candidate_ids.empty())
+      _pq.template distances<D>(v_node->data(), &candidate_ids[0], candidate_ids.size(), &candidate_dists[0]);
+    else if (!candidates.empty())
+      D::distance_many(v_node, &candidates[0], candidates.size(), _f, &candidate_dists[0]);
+    vector<pair<T, S> > nns_dist(candidate_ids.size());
+    for (size_t i = 0; i < candidate_ids.size(); i++)
+      nns_dist[i] = make_pair(candidate_dists[i], candidate_ids[i]);
+    if (!fat.empty()) {
+      // The copies are scored where they are, one leaf after another. An
+      // item is in one leaf of each tree at most, so the best want * trees
+      // candidates have the best want items; only their repeats are dropped.
+      vector<T> fat_dists(fat.size());
+      D::distance_many(v_node, &fat[0], fat.size(), _f, &fat_dists[0]);
+      for (size_t i = 0; i < fat.size(); i++)
+        nns_dist.push_back(make_pair(fat_dists[i], fat[i]->n_descendants));
+      const size_t want = _rescore_factor > 0 && _has_exact() ? n * _rescore_factor : n;
+      const size_t keep = std::min(nns_dist.size(), want * _roots.size());
+      std::partial_sort(nns_dist.begin(), nns_dist.begin() + keep, nns_dist.end());
+      nns_dist.resize(keep);
+      std::sort(nns_dist.begin(), nns_dist.end(), _id_less);
+      nns_dist.erase(std::unique(nns_dist.begin(), nns_dist.end(), _id_equal), nns_dist.end());
     }
 
     size_t m = nns_dist.size();
     size_t p = n < m ? n : m; // Return this many items
+    if (_rescore_factor > 0 && _has_exact() && m > 0) {
+      // The stored vectors are approximate: rank the best candidates again by
+      // their full precision vectors
+      size_t r = std::min(m, p * _rescore_factor);
+      std::partial_sort(nns_dist.begin(), nns_dist.begin() + r, nns_dist.end());
+      nns_dist.resize(r);
+      _rescore(v_node, &nns_dist);
+      m = r;
+    }
     std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
     for (size_t i = 0; i < p; i++) {
       if (distances)
         distances->push_back(D::normalized_distance(nns_dist[i].first));
-      result->push_back(nns_dist[i].second);
+      result->push_back(_to_external(nns_dist[i].second));
+    }
+  }
+
+  static bool _id_less(const pair<T, S>& a, const pair<T, S>& b) {
+    return a.second < b.second;
+  }
+
+  static bool _id_equal(const pair<T, S>& a, const pair<T, S>& b) {
+    return a.second == b.second;
+  }
+
+  void _rescore(const FullNode* v_node, vector<pair<T, S> >* nns_dist) const {
+    size_t r = nns_dist->size();
+    vector<char> buf(r * _fs);
+    vector<const FullNode*> exact(r);
+    for (size_t i = 0; i < r; i++) {
+      FullNode* e = (FullNode*)&buf[i * _fs];
+      D::template zero_value<FullNode>(e);
+      memcpy(e->v, _get_exact((*nns_dist)[i].second), _f * sizeof(T));
+      D::init_node(e, _f);
+      exact[i] = e;
     }
+    vector<T> dists(r);
+    D::distance_many(v_node, &exact[0], r, _f, &dists[0]);
+    for (size_t i = 0; i < r; i++)
+      (*nns_dist)[i].first = dists[i];
   }
 };
 
@@ -27,20 +27,24 @@ int bench(int f=100, int n=1000000){
 	AnnoyIndex<int, double, Angular, Kiss64Random> t = AnnoyIndex<int, double, Angular, Kiss64Random>(f);
 
 	std::cout << "Building index ... be patient !!" << std::endl;
+	std::cout << "Distance kernels: " << t.get_kernel_name() << std::endl;
 	std::cout << "\"Trees that are slow to grow bear the best fruit\" (Moliere)" << std::endl;
 
 
 
-	for(int i=0; i<n; ++i){
-		double *vec = (double *) malloc( f * sizeof(double) );
+	// Generated and added a block of rows at a time
+	const int block = 65536;
+	std::vector<double> vecs((size_t)std::min(n, block) * f);
+	for(int i=0; i<n; i+=block){
+		int count = std::min(block, n - i);
 
-		for(int z=0; z<f; ++z){
-			vec[z] = (distribution(generator));
+		for(size_t z=0; z<(size_t)count * f; ++z){
+			vecs[z] = (distribution(generator));
 		}
 
-		t.add_item(i, vec);
+		t.add_items(&vecs[0], i, count);
 
-		std::cout << "Loading objects ...\t object: "<< i+1 << "\tProgress:"<< std::fixed << std::setprecision(2) << (double) i / (double)(n + 1) * 100 << "%\r";
+		std::cout << "Loading objects ...\t object: "<< i+count << "\tProgress:"<< std::fixed << std::setprecision(2) << (double) (i+count) / (double)n * 100 << "%\r" << std::flush;
 
 	}
 	std::cout << std::endl;
@@ -50,6 +54,7 @@ int bench(int f=100, int n=1000000){
 	t_end = std::chrono::high_resolution_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( t_end - t_start ).count();
 	std::cout << " Done in "<< duration << " ms." << std::endl;
+	std::cout << "Huge pages: " << (t.get_hugepage_bytes() >> 20) << " MB" << std::endl;
 
 
 	std::cout << "Saving index ...";
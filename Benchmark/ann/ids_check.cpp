@@ -0,0 +1,85 @@
+/*
+ * ids_check.cpp
+ *
+ * Builds and queries sparse indexes with one item id above 2^31, for wide
+ * and unsigned id types. The items in between are never added, so the
+ * nodes take address space but hardly any memory.
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include "kissrandom.h"
+#include "annoylib.h"
+
+static const int f = 2;
+static const int n_dense = 10000;
+
+template<typename S>
+static int check(const char* name, S high_id){
+	std::default_random_engine generator;
+	std::normal_distribution<float> distribution(0.0, 1.0);
+	AnnoyIndex<S, float, Euclidean, Kiss64Random> t(f);
+	int failures = 0;
+
+	std::vector<float> v(f);
+	for(int i=0; i<n_dense; ++i){
+		for(int z=0; z<f; ++z)
+			v[z] = distribution(generator);
+		t.add_item((S)i, &v[0]);
+	}
+	// Far from all others, so it is its own nearest neighbor by a margin
+	std::vector<float> far(f, 100.0f);
+	char* error = NULL;
+	if(!t.add_item(high_id, &far[0], &error)){
+		std::cout << name << ": add_item(" << (uint64_t)high_id << ") failed: " << error << std::endl;
+		return 1;
+	}
+	if((uint64_t)t.get_n_items() != (uint64_t)high_id + 1){
+		std::cout << name << ": " << (uint64_t)t.get_n_items() << " items" << std::endl;
+		failures++;
+	}
+
+	t.set_seed(1);
+	if(!t.build(4, -1, &error)){
+		std::cout << name << ": build failed: " << error << std::endl;
+		return failures + 1;
+	}
+
+	std::vector<S> result;
+	std::vector<float> distances;
+	t.get_nns_by_vector(&far[0], 3, -1, &result, &distances);
+	if(result.empty() || result[0] != high_id || distances[0] != 0.0f){
+		std::cout << name << ": the nearest neighbor of the high item is not itself" << std::endl;
+		failures++;
+	}
+	result.clear();
+	t.get_nns_by_item(high_id, 3, -1, &result, NULL);
+	if(result.empty() || result[0] != high_id){
+		std::cout << name << ": get_nns_by_item(" << (uint64_t)high_id << ") misses the item" << std::endl;
+		failures++;
+	}
+	result.clear();
+	t.get_nns_by_item((S)0, 5, -1, &result, NULL);
+	for(size_t i=0; i<result.size(); ++i){
+		if(result[i] != high_id && (uint64_t)result[i] >= (uint64_t)n_dense){
+			std::cout << name << ": an item that was never added came up" << std::endl;
+			failures++;
+			break;
+		}
+	}
+	std::cout << "Checked " << name << " up to id " << (uint64_t)high_id << std::endl;
+	return failures;
+}
+
+int main() {
+	const uint64_t high_id = ((uint64_t)1 << 31) + 5;
+	int failures = 0;
+	failures += check<int64_t>("int64_t", (int64_t)high_id);
+	failures += check<uint32_t>("uint32_t", (uint32_t)high_id);
+	if(failures){
+		std::cout << failures << " failed checks of sparse indexes" << std::endl;
+		return 1;
+	}
+	return 0;
+}
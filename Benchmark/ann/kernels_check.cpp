@@ -0,0 +1,145 @@
+/*
+ * kernels_check.cpp
+ *
+ * Compares every vectorized kernel the host can run against the scalar
+ * kernels, for all lengths from 1 to 130 so that each remainder path is hit.
+ */
+
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include <random>
+#include "kissrandom.h"
+#include "annoylib.h"
+
+static const int max_f = 130;
+static const size_t n_many = 11; // Not a multiple of the batch width
+
+static int failures = 0;
+
+static void expect_close(const char* table, const char* kernel, int f, double expected, double actual){
+	double tolerance = 1e-9 * std::max(1.0, std::fabs(expected));
+	if(std::fabs(expected - actual) > tolerance){
+		if(failures++ < 20)
+			std::cout << table << " " << kernel << " f=" << f << ": expected " << expected << ", got " << actual << std::endl;
+	}
+}
+
+static void expect_equal(const char* table, const char* kernel, int f, uint64_t expected, uint64_t actual){
+	if(expected != actual){
+		if(failures++ < 20)
+			std::cout << table << " " << kernel << " f=" << f << ": expected " << expected << ", got " << actual << std::endl;
+	}
+}
+
+static void check_double(const DistanceKernels<double>* k, int f, std::default_random_engine& generator){
+	const DistanceKernels<double>* s = &ScalarKernels<double>::table;
+	std::normal_distribution<double> distribution(0.0, 1.0);
+
+	std::vector<double> x(f);
+	std::vector<std::vector<double> > ys(n_many, std::vector<double>(f));
+	std::vector<const double*> ptrs(n_many);
+	for(int z=0; z<f; ++z)
+		x[z] = distribution(generator);
+	for(size_t i=0; i<n_many; ++i){
+		for(int z=0; z<f; ++z)
+			ys[i][z] = distribution(generator);
+		ptrs[i] = &ys[i][0];
+	}
+
+	expect_close(k->name, "dot", f, s->dot(&x[0], ptrs[0], f), k->dot(&x[0], ptrs[0], f));
+	expect_close(k->name, "manhattan_distance", f, s->manhattan_distance(&x[0], ptrs[0], f), k->manhattan_distance(&x[0], ptrs[0], f));
+	expect_close(k->name, "euclidean_distance", f, s->euclidean_distance(&x[0], ptrs[0], f), k->euclidean_distance(&x[0], ptrs[0], f));
+
+	// Every batch size up to n_many, so that the tail of a batch is covered too
+	std::vector<double> expected(n_many), actual(n_many);
+	for(size_t n=1; n<=n_many; ++n){
+		s->dot_many(&x[0], &ptrs[0], n, f, &expected[0]);
+		k->dot_many(&x[0], &ptrs[0], n, f, &actual[0]);
+		for(size_t i=0; i<n; ++i)
+			expect_close(k->name, "dot_many", f, expected[i], actual[i]);
+		s->manhattan_distance_many(&x[0], &ptrs[0], n, f, &expected[0]);
+		k->manhattan_distance_many(&x[0], &ptrs[0], n, f, &actual[0]);
+		for(size_t i=0; i<n; ++i)
+			expect_close(k->name, "manhattan_distance_many", f, expected[i], actual[i]);
+		s->euclidean_distance_many(&x[0], &ptrs[0], n, f, &expected[0]);
+		k->euclidean_distance_many(&x[0], &ptrs[0], n, f, &actual[0]);
+		for(size_t i=0; i<n; ++i)
+			expect_close(k->name, "euclidean_distance_many", f, expected[i], actual[i]);
+	}
+
+	std::vector<double> y_scalar(ys[1]), y_vector(ys[1]);
+	s->axpby(0.25, &x[0], 0.75, &y_scalar[0], f);
+	k->axpby(0.25, &x[0], 0.75, &y_vector[0], f);
+	for(int z=0; z<f; ++z)
+		expect_close(k->name, "axpby", f, y_scalar[z], y_vector[z]);
+}
+
+static void check_bits(const DistanceKernels<uint64_t>* k, int f, Kiss64Random& random){
+	const DistanceKernels<uint64_t>* s = &ScalarKernels<uint64_t>::table;
+
+	std::vector<uint64_t> x(f);
+	std::vector<std::vector<uint64_t> > ys(n_many, std::vector<uint64_t>(f));
+	std::vector<const uint64_t*> ptrs(n_many);
+	for(int z=0; z<f; ++z)
+		x[z] = random.kiss();
+	for(size_t i=0; i<n_many; ++i){
+		for(int z=0; z<f; ++z)
+			ys[i][z] = random.kiss();
+		ptrs[i] = &ys[i][0];
+	}
+
+	expect_equal(k->name, "hamming_distance", f, s->hamming_distance(&x[0], ptrs[0], f), k->hamming_distance(&x[0], ptrs[0], f));
+
+	std::vector<uint64_t> expected(n_many), actual(n_many);
+	for(size_t n=1; n<=n_many; ++n){
+		s->hamming_distance_many(&x[0], &ptrs[0], n, f, &expected[0]);
+		k->hamming_distance_many(&x[0], &ptrs[0], n, f, &actual[0]);
+		for(size_t i=0; i<n; ++i)
+			expect_equal(k->name, "hamming_distance_many", f, expected[i], actual[i]);
+
+		std::vector<uint64_t> any_scalar(f), all_scalar(f), any_vector(f), all_vector(f);
+		s->bit_occupancy(&ptrs[0], n, f, &any_scalar[0], &all_scalar[0]);
+		k->bit_occupancy(&ptrs[0], n, f, &any_vector[0], &all_vector[0]);
+		for(int z=0; z<f; ++z){
+			expect_equal(k->name, "bit_occupancy any", f, any_scalar[z], any_vector[z]);
+			expect_equal(k->name, "bit_occupancy all", f, all_scalar[z], all_vector[z]);
+		}
+	}
+}
+
+int main() {
+	std::default_random_engine generator;
+	Kiss64Random random;
+	const int host_isa = detect_isa();
+	const int isas[] = {ANNOY_ISA_AVX2, ANNOY_ISA_AVX512, ANNOY_ISA_AVX512_VPOPCNTDQ};
+	int checked = 0;
+
+	for(size_t i=0; i<sizeof(isas)/sizeof(isas[0]); ++i){
+		const int isa = isas[i];
+		if(isa > host_isa)
+			break;
+		const DistanceKernels<double>* doubles = isa_kernels<double>(isa);
+		const DistanceKernels<uint64_t>* bits = isa_kernels<uint64_t>(isa);
+		for(int f=1; f<=max_f; ++f){
+			if(doubles != &ScalarKernels<double>::table)
+				check_double(doubles, f, generator);
+			if(bits != &ScalarKernels<uint64_t>::table)
+				check_bits(bits, f, random);
+			// The kernels specialized for one dimension only run at that dimension
+			const DistanceKernels<double>* fixed = fixed_dim_kernels<double>(isa, f);
+			if(fixed)
+				check_double(fixed, f, generator);
+		}
+		std::cout << "Checked " << doubles->name << ", " << bits->name << std::endl;
+		++checked;
+	}
+
+	if(!checked)
+		std::cout << "No vectorized kernels on this host" << std::endl;
+	if(failures){
+		std::cout << failures << " mismatches against the scalar kernels" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -50,6 +50,8 @@ struct Kiss32Random {
   }
   inline size_t index(size_t n) {
     // Draw random integer between 0 and n-1 where n is at most the number of data points you have
+    if ((uint64_t)n > 0xffffffffULL)
+      return (((uint64_t)kiss() << 32) | kiss()) % n; // Two draws, or ids past 2^32 would never come up
     return kiss() % n;
   }
   inline void set_seed(uint32_t seed) {
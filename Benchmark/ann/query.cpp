@@ -39,6 +39,7 @@ int bench(int f=100, int n=1000000, int query_n=300000){
 	// std::cout << "Saving index ...";
 	t.load("ann.tree", false);
 	std::cout << "Loading Done" << std::endl;
+	std::cout << "Distance kernels: " << t.get_kernel_name() << std::endl;
 
 
 
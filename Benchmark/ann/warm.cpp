@@ -16,7 +16,7 @@
 #include <map>
 #include <random>
 
-int bench(int f=100, int n=1000000, int query_n=300000){
+int bench(int f=100, int strategy=ANNOY_WARM_TOUCH){
 	std::chrono::high_resolution_clock::time_point t_start, t_end;
 
 	std::default_random_engine generator;
@@ -37,8 +37,13 @@ int bench(int f=100, int n=1000000, int query_n=300000){
 
 
 	// std::cout << "Saving index ...";
-	t.load("ann.tree", true);
-	std::cout << "Pre-touching Done" << std::endl;
+	t.load("ann.tree");
+	WarmupOptions options;
+	options.strategy = strategy;
+	WarmupStats stats;
+	t.warmup(options, &stats);
+	std::cout << "Pre-touching Done: " << (stats.bytes >> 20) << " MB in " << stats.seconds << " s ("
+		<< (size_t)stats.bytes_per_second() / (1 << 20) << " MB/s, trees warm after " << stats.tree_seconds << " s)" << std::endl;
 
 	// std::cout << "\nDone" << std::endl;
 	return 0;
@@ -70,11 +75,16 @@ int main(int argc, char **argv) {
 
 
 	int query_n = 300000;
-	if(argc == 2)
+	if(argc >= 2)
 		query_n = atoi(argv[1]);
+	// touch, readahead or topdown
+	int strategy = ANNOY_WARM_TOUCH;
+	if(argc >= 3)
+		strategy = std::string(argv[2]) == "readahead" ? ANNOY_WARM_READAHEAD
+			: std::string(argv[2]) == "topdown" ? ANNOY_WARM_TOP_DOWN : ANNOY_WARM_TOUCH;
 
 	std::cout << "query number: " << query_n << std::endl;
-	bench(f, n, query_n);
+	bench(f, strategy);
 
 
 	return EXIT_SUCCESS;